@@ -6,38 +6,2773 @@
  * Does not print a newline at the end (this is intended to be easily called
  * from within scripts etc)
  *
+ * Bulk mode: "-c <count>" prints count passwords, one per line, generated
+ * on several threads (-t <n>, default one per CPU). "-l <length>" sets the
+ * password length. Each thread has its own ChaCha20 generator keyed from
+ * the kernel, and output is written in large blocks.
+ *
+ * Random bytes are drawn from a pool refilled 4KB at a time, straight from
+ * getrandom() for a single password or from the thread's ChaCha20 in bulk
+ * mode, and mapped to characters by rejection sampling so every character
+ * is equally likely. "--stats" prints how many bytes each character cost.
+ *
+ * For charsets of up to 256 characters each byte is looked up in a table
+ * (0 meaning rejected) and the surviving characters packed together, a
+ * whole pool at a time. On x86 this is done 16 or 32 bytes at a time with
+ * SSSE3/AVX2 shuffles when the CPU has them; "--scalar" forces the plain C
+ * version, which gives exactly the same output.
+ *
+ * Password policy: "--range a-z0-9" and "--ascii" (printable ASCII) build a
+ * charset, "--exclude <chars>" and "--noambiguous" remove characters from
+ * it, "--firstalpha" makes the first character a letter and --minlower,
+ * --minupper, --mindigit and --minsymbol <n> require that many characters
+ * of each class. These are compiled into per-class samplers at startup,
+ * and every password meeting the policy is equally likely: one drawn from
+ * the whole charset is kept if it happens to qualify, otherwise the number
+ * of characters of each class is drawn, weighted by how many passwords
+ * have that split, and the characters drawn from their classes and
+ * shuffled. Passwords over 1024 characters are just redrawn, and policies
+ * too strict for that are refused.
+ *
+ * Random number backends (--rng <name>): getrandom (the default for a
+ * single password), chacha (per thread ChaCha20, the default with -c), aes
+ * (AES-128 in counter mode using AES-NI, if the CPU has it) and random
+ * (the old srandom(time(NULL))/random(), for comparison only). "--bench"
+ * times every available backend over several charset sizes and lengths,
+ * printing passwords/sec, MB/sec and CPU cycles per character, and runs a
+ * chi-square test on the characters so a fast backend can't hide a biased
+ * one.
+ *
+ * Passphrases: "--words <n> --wordlist <file>" picks n words from a word
+ * list (one per line; only the last word on each line is used, so diceware
+ * lists with dice numbers work as-is). An index of where each word starts
+ * is built the first time and saved as <file>.idx; later runs mmap the
+ * index and the list, so choosing a word is one lookup however long the
+ * list is. Words are separated by "--sep <str>" (default a space), or with
+ * "--randsep" by a random character from the charset options above. -c,
+ * -t and --rng work as for passwords.
+ *
+ * "--unique" guarantees no password is printed twice in a run (for batches
+ * of one-time codes). Codes are packed into a 64 bit number in base <size
+ * of charset> where that fits, and tracked in a bitmap when the keyspace is
+ * small enough, otherwise in an open addressing hash set split into
+ * separately locked shards so the threads rarely contend; duplicates are
+ * simply drawn again. Counts over the number of passwords meeting the
+ * policy are refused. When the count is over half the keyspace and every
+ * code is allowed, a repeat is replaced by a free code picked directly
+ * from the bitmap, so even the whole keyspace takes one draw per code;
+ * otherwise a warning is printed, as the last codes take many draws.
+ *
+ * Server mode: "--serve" stays running and answers request lines of the
+ * form "<length> [<charset> [<count>]]" on stdin, or with "--socket <path>"
+ * from any number of clients on a Unix socket, one thread per client. The
+ * charset is one of an, alpha, num, all, ascii, "default" (the charset and
+ * policy given on the command line) or a --range style spec. Each request
+ * is answered with count passwords, one per line, or a single "ERR ..."
+ * line. Charset tables are compiled once at startup and each client keeps
+ * its own generator and entropy pool, filled before the first request.
+ *
+ * Reproducible output: "--seed <hex>" (a number of up to 64 hex digits)
+ * keys ChaCha20 with the seed instead of the kernel, and password number
+ * i is generated from the keystream with nonce i alone, starting from a
+ * fresh pool. Each password therefore depends only on the seed and its
+ * index, whatever the thread count or SIMD kernel, and "--start <i>"
+ * generates from index i on, so "-c 1000 --start 0" and "-c 1000 --start
+ * 1000" are the two halves of "-c 2000". Threads hand out batches of
+ * indexes round robin and write them in order. Anyone with the seed can
+ * regenerate every password, so this is meant for test fixtures.
+ *
+ * Build with: cc -O2 -pthread -o randompw randompw.c -lm
+ *
  */
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define PASSLEN 8
+#define MAXLEN 65536
+#define MAXCHARS 65536
+#define POOLLEN 4096                // multiple of the 64 byte ChaCha block
+#define MAXTHREADS 64
+#define OUTBUFLEN (1 << 20)
+#define PERTHREADMIN 4096  // don't start a thread for fewer passwords
+#define BENCHCHARS (8 << 20)        // characters per --bench run
+#define CHISQCHARS (1 << 20)        // characters for the chi-square test
+#define MAXWORDS 1024               // words per passphrase
+#define IDXEXT ".idx"
+#define IDXMAGIC "RPWIDX2"
+#define SHARDBITS 6                 // 64 locked shards in the --unique set
+#define NSHARDS (1 << SHARDBITS)
+#define BITMAPMAX (1ULL << 33)      // largest --unique bitmap, in bits
+#define MAXRETRIES 1000000          // duplicates in a row before giving up
+#define BLOCKWORDS 8                // bitmap words per free count, --unique
+#define REQLEN 512                  // longest --serve request line
+#define COMPMAX 1024                // longest password with --min* tables
+#define DRAWALLCHANCE 0.5           // pass rate worth a plain draw first
+#define JOINTMAX 32                 // longest password drawn in one pick
+#define SEEDLEN 32                  // bytes of --seed, the ChaCha20 key
+#define SEEDCHUNK 64                // pool refill with --seed, one block
+
+#define NUMONLY "1234567890"
+#define ALPHAONLY \
+   "qwertyuiopQWERYTUIOPasdfghjklASDFGHJKLzxcvbnmZXCVBNM"
+#define ALPHANUM \
+   "qwertyuiopQWERYTUIOPasdfghjklASDFGHJKLzxcvbnmZXCVBNM1234567890"
+
+   /* There are too many special cases for the following to be really
+    * practical, if it was used as-is. A better approach would be to
+    * just use a certain subset of ASCII with an option to exclude a
+    * specified set of characters (see --ascii and --exclude) */
+#define ALPHANUMSPECIAL \
+   "qwertyuiopQWERYTUIOPasdfghjklASDFGHJKLzxcvbnmZXCVBNM1234567890_-+="
+#define ASCIIRANGE "!-~"
+#define AMBIGUOUS "0Oo1Il|`'\""
+
+/* character classes for --min* */
+#define CLASS_LOWER 0
+#define CLASS_UPPER 1
+#define CLASS_DIGIT 2
+#define CLASS_SYMBOL 3
+#define NCLASSES 4
+#define CLASS_ANY -1
+#define CLASS_ALPHA -2
+
+/* ChaCha20 (original 64 bit counter/64 bit nonce layout) */
+typedef struct
+{
+   uint32_t key[8];
+   uint32_t nonce[2];
+   uint64_t counter;
+   uint32_t block[16];
+} ChaCha;
+
+/* AES-128 in counter mode; round keys are __m128i when AES-NI is used */
+typedef struct
+{
+   unsigned char rk[11 * 16];
+   uint64_t counter;
+   uint64_t nonce;
+} AesCtr;
+
+typedef union
+{
+   ChaCha cc;
+   AesCtr aes;
+} RngState;
+
+/* A source of random bytes; fill is always called with a multiple of 64 */
+typedef struct
+{
+   const char * name;
+   int (*available)(void);
+   void (*init)(RngState * st, uint32_t id);
+   void (*fill)(RngState * st, unsigned char * buf, size_t len);
+} Backend;
+
+/* Entropy pool, refilled from a backend */
+typedef struct
+{
+   unsigned char buf[POOLLEN];
+   size_t pos;
+   size_t len;
+   const Backend * rng;
+   RngState * state;
+   size_t chunk;                    // bytes per refill
+   unsigned long long bytesIn;      // stats: bytes put in the pool
+   unsigned long long refills;
+} Pool;
+
+/* Maps uniform random numbers below limit onto size characters */
+typedef struct
+{
+   const char * chars;
+   unsigned size;
+   unsigned limit;                  // largest multiple of size we can draw
+   int wide;                        // size > 256, draw 16 bits at a time
+   unsigned char map[256];          // byte -> character, 0 if rejected
+   uint16_t recip;                  // (b * recip) >> 16 == b / size
+   int simdOk;                      // recip is exact for every byte
+} Sampler;
+
+/* Characters already mapped from the pool, waiting to be used */
+typedef struct
+{
+   char buf[POOLLEN + 32];          // SIMD kernels store a little past the end
+   size_t pos;
+   size_t len;
+   size_t inLen;                    // stats: pool bytes mapped to fill buf
+} CharStream;
+
+/* maps n bytes to characters, dropping rejects; returns characters written */
+typedef size_t (*MapKernel)(const Sampler * smp,
+                            const unsigned char * in, size_t n, char * out);
+
+/* Compiled password policy; every sampler is built once at startup */
+typedef struct
+{
+   Sampler all;                     // the whole charset
+   Sampler alpha;                   // letters only, for --firstalpha
+   Sampler cls[NCLASSES];           // each class on its own
+   unsigned minClass[NCLASSES];
+   unsigned required;               // sum of minClass
+   int firstAlpha;
+   unsigned char classOf[256];      // char_class of every character
+} Policy;
+
+/* How many characters of each class a password gets, for --min*. Counts
+ * are drawn digits first, then symbols, then lowercase, the rest being
+ * uppercase, each weighted by the number of valid passwords it leaves
+ * (all as logs, as the numbers are huge) */
+typedef struct
+{
+   unsigned length;                 // tables are for this length, 0 = none
+   int drawAll;                     // a plain draw usually passes, try it
+   double q[3];                     // class share of the classes left
+   double * lf;                     // log k!
+   double * rest;                   // log weight of r places after digits
+   double * letters;                // log weight of t places for letters
+   uint32_t ** cdf[3];              // per class and places left, cumulative
+                                    // chance of each count in 32 bit fixed
+                                    // point, built on use
+   uint32_t * joint;                // up to JOINTMAX, cumulative chance of
+   uint32_t * split;                // each whole split, packed 10 bits a
+   unsigned splits;                 // class: digits, symbols, lowercase
+} Composition;
+
+/* per thread state for drawing from a Policy */
+typedef struct
+{
+   CharStream all;
+   CharStream alpha;
+   CharStream cls[NCLASSES];
+   Composition comp;                // built on first use
+} PolicyStreams;
+
+/* A word in the word list, and the header of the saved index of them */
+typedef struct
+{
+   uint32_t off;
+   uint32_t len;
+} WordRef;
+
+typedef struct
+{
+   char magic[8];
+   uint64_t dev;
+   uint64_t ino;
+   uint64_t size;
+   int64_t mtime;
+   int64_t ctime;
+   uint32_t count;
+   uint32_t maxLen;
+} WordIndexHdr;
+
+typedef struct
+{
+   const char * text;               // the word list, mmapped
+   const WordRef * words;           // mmapped from the .idx if possible
+   uint32_t size;                   // of text
+   uint32_t count;
+   uint32_t maxLen;
+} WordList;
+
+/* --unique: codes already printed */
+typedef struct
+{
+   pthread_mutex_t lock;
+   unsigned char * slots;           // keyLen bytes each, all zero = empty
+   size_t size;                     // a power of two
+   size_t used;
+} UniqueShard;
+
+typedef struct
+{
+   int packed;                      // keys are codes packed in base `base'
+   int bitmap;                      // packed keys are bits in bits[]
+   uint64_t * bits;
+   unsigned keyLen;                 // 8 if packed, else the password length
+   unsigned length;
+   uint64_t base;
+   unsigned char digit[256];        // character -> digit when packed
+   char symbol[256];                // digit -> character
+   UniqueShard shard[NSHARDS];
+   uint64_t valid;                  // passwords meeting the policy
+   uint64_t added;
+   int dense;                       // pick from the free keys on a repeat
+   pthread_mutex_t denseLock;       // one unique_pick at a time
+   uint64_t * tree;                 // free keys per block (Fenwick tree)
+   size_t blocks;
+   size_t words;                    // in bits[]
+   uint64_t freeKeys;
+} UniqueSet;
+
+typedef struct
+{
+   const Policy * policy;
+   UniqueSet * unique;              // don't repeat codes if set
+   const WordList * wordList;       // passphrase mode if set
+   unsigned nwords;
+   const char * sep;                // NULL = random character separators
+   unsigned length;
+   int newline;
+   const Backend * rng;
+   unsigned long long count;        // passwords for this thread
+   unsigned id;
+   const uint32_t * seed;           // ChaCha20 key for --seed, else NULL
+   unsigned long long first;        // --seed: index of the first password
+   unsigned threads;                // --seed: threads sharing the batches
+   unsigned long long charsOut;     // stats
+   unsigned long long bytesUsed;
+   unsigned long long refills;
+   pthread_t thread;
+} Job;
+
+pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t outTurnCond = PTHREAD_COND_INITIALIZER;
+unsigned long long outTurn;         // --seed: next batch to be written
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) \
+   a += b; d ^= a; d = ROTL32(d, 16); \
+   c += d; b ^= c; b = ROTL32(b, 12); \
+   a += b; d ^= a; d = ROTL32(d, 8);  \
+   c += d; b ^= c; b = ROTL32(b, 7);
+
+void chacha_block(ChaCha * cc)
+{
+   uint32_t x[16];
+   int i;
+
+   x[0] = 0x61707865; x[1] = 0x3320646e; x[2] = 0x79622d32; x[3] = 0x6b206574;
+   for (i = 0; i < 8; i++)
+      x[4 + i] = cc->key[i];
+   x[12] = (uint32_t)cc->counter;
+   x[13] = (uint32_t)(cc->counter >> 32);
+   x[14] = cc->nonce[0];
+   x[15] = cc->nonce[1];
+   memcpy(cc->block, x, sizeof(x));
+
+   for (i = 0; i < 10; i++)
+   {
+      QR(x[0], x[4], x[8],  x[12]);
+      QR(x[1], x[5], x[9],  x[13]);
+      QR(x[2], x[6], x[10], x[14]);
+      QR(x[3], x[7], x[11], x[15]);
+      QR(x[0], x[5], x[10], x[15]);
+      QR(x[1], x[6], x[11], x[12]);
+      QR(x[2], x[7], x[8],  x[13]);
+      QR(x[3], x[4], x[9],  x[14]);
+   }
+   for (i = 0; i < 16; i++)
+      cc->block[i] += x[i];
+
+   cc->counter++;
+}
+
+// fill buf (len a multiple of 64) with keystream, little endian
+void chacha_fill(ChaCha * cc, unsigned char * buf, size_t len)
+{
+   size_t i;
+
+   for (; len >= 64; len -= 64)
+   {
+      chacha_block(cc);
+      for (i = 0; i < 16; i++, buf += 4)
+      {
+         buf[0] = cc->block[i];
+         buf[1] = cc->block[i] >> 8;
+         buf[2] = cc->block[i] >> 16;
+         buf[3] = cc->block[i] >> 24;
+      }
+   }
+}
+
+// fill buf from the kernel, falling back to /dev/urandom
+void get_entropy(void * buf, size_t len)
+{
+   unsigned char * p = buf;
+
+   while (len)
+   {
+      ssize_t got = getrandom(p, len, 0);
+      if (got < 0 && errno == EINTR)
+         continue;
+      if (got < 0)
+      {
+         int fd = open("/dev/urandom", O_RDONLY);
+         if (fd < 0 || (got = read(fd, p, len)) <= 0)
+         {
+            fprintf(stderr, "Can't get random data\n");
+            exit(EXIT_FAILURE);
+         }
+         close(fd);
+      }
+      p += got;
+      len -= got;
+   }
+}
+
+void chacha_init(ChaCha * cc, uint32_t id)
+{
+   get_entropy(cc->key, sizeof(cc->key));
+   cc->nonce[0] = id;
+   cc->nonce[1] = 0;
+   cc->counter = 0;
+}
+
+void rng_getrandom_fill(RngState * st, unsigned char * buf, size_t len)
+{
+   (void)st;
+   get_entropy(buf, len);
+}
+
+void rng_chacha_init(RngState * st, uint32_t id)
+{
+   chacha_init(&st->cc, id);
+}
+
+void rng_chacha_fill(RngState * st, unsigned char * buf, size_t len)
+{
+   chacha_fill(&st->cc, buf, len);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("aes,sse2")))
+static inline __m128i aes_expand(__m128i key, __m128i gen)
+{
+   gen = _mm_shuffle_epi32(gen, 0xFF);
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   return _mm_xor_si128(key, gen);
+}
+
+int rng_aes_available()
+{
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("aes");
+}
+
+__attribute__((target("aes,sse2")))
+void rng_aes_init(RngState * st, uint32_t id)
+{
+   __m128i * rk = (__m128i *)st->aes.rk;
+   unsigned char key[16];
+
+   get_entropy(key, sizeof(key));
+   rk[0] = _mm_loadu_si128((const __m128i *)key);
+#define AES_ROUNDKEY(i, rcon) \
+   rk[i] = aes_expand(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+   AES_ROUNDKEY(1, 0x01); AES_ROUNDKEY(2, 0x02); AES_ROUNDKEY(3, 0x04);
+   AES_ROUNDKEY(4, 0x08); AES_ROUNDKEY(5, 0x10); AES_ROUNDKEY(6, 0x20);
+   AES_ROUNDKEY(7, 0x40); AES_ROUNDKEY(8, 0x80); AES_ROUNDKEY(9, 0x1B);
+   AES_ROUNDKEY(10, 0x36);
+#undef AES_ROUNDKEY
+   st->aes.counter = 0;
+   st->aes.nonce = id;
+}
+
+// four blocks at a time so the AES units stay busy
+__attribute__((target("aes,sse2")))
+void rng_aes_fill(RngState * st, unsigned char * buf, size_t len)
+{
+   const __m128i * rk = (const __m128i *)st->aes.rk;
+   __m128i b[4];
+   unsigned r, j;
+
+   for (; len >= 64; len -= 64, buf += 64)
+   {
+      for (j = 0; j < 4; j++)
+         b[j] = _mm_xor_si128(_mm_set_epi64x(st->aes.nonce,
+                                             st->aes.counter++), rk[0]);
+      for (r = 1; r < 10; r++)
+         for (j = 0; j < 4; j++)
+            b[j] = _mm_aesenc_si128(b[j], rk[r]);
+      for (j = 0; j < 4; j++)
+         _mm_storeu_si128((__m128i *)(buf + 16 * j),
+                          _mm_aesenclast_si128(b[j], rk[10]));
+   }
+}
+#endif
+
+pthread_once_t randomSeeded = PTHREAD_ONCE_INIT;
+
+void random_seed()
+{
+   srandom(time(NULL));
+}
+
+void rng_random_init(RngState * st, uint32_t id)
+{
+   (void)st;
+   (void)id;
+   pthread_once(&randomSeeded, random_seed);
+}
+
+// 24 of the 31 bits from each call
+void rng_random_fill(RngState * st, unsigned char * buf, size_t len)
+{
+   (void)st;
+   while (len >= 3)
+   {
+      long r = random();
+      *buf++ = r;
+      *buf++ = r >> 8;
+      *buf++ = r >> 16;
+      len -= 3;
+   }
+   while (len--)
+      *buf++ = random();
+}
+
+const Backend backends[] =
+{
+   { "getrandom", NULL, NULL, rng_getrandom_fill },
+   { "chacha", NULL, rng_chacha_init, rng_chacha_fill },
+#ifdef HAVE_X86_SIMD
+   { "aes", rng_aes_available, rng_aes_init, rng_aes_fill },
+#endif
+   { "random", NULL, rng_random_init, rng_random_fill },
+};
+#define NBACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+const Backend * find_backend(const char * name)
+{
+   unsigned i;
+
+   for (i = 0; i < NBACKENDS; i++)
+      if (strcmp(backends[i].name, name) == 0)
+         return (!backends[i].available || backends[i].available())
+                ? &backends[i] : NULL;
+   return NULL;
+}
+
+// point pool at a freshly initialised backend
+void pool_init(Pool * pool, const Backend * rng, RngState * st, uint32_t id)
+{
+   memset(pool, 0, sizeof(*pool));
+   pool->rng = rng;
+   pool->state = st;
+   pool->chunk = POOLLEN;
+   if (rng->init)
+      rng->init(st, id);
+}
+
+void pool_refill(Pool * pool)
+{
+   pool->rng->fill(pool->state, pool->buf, pool->chunk);
+   pool->pos = 0;
+   pool->len = pool->chunk;
+   pool->bytesIn += pool->chunk;
+   pool->refills++;
+}
+
+// point pool at ChaCha20 keyed with a --seed, one block per refill
+void pool_seed(Pool * pool, RngState * st, const uint32_t * key)
+{
+   memset(pool, 0, sizeof(*pool));
+   memset(st, 0, sizeof(*st));
+   memcpy(st->cc.key, key, sizeof(st->cc.key));
+   pool->rng = find_backend("chacha");
+   pool->state = st;
+   pool->chunk = SEEDCHUNK;
+}
+
+// restart a seeded pool at the keystream for password index
+void pool_seek(Pool * pool, unsigned long long index)
+{
+   pool->state->cc.nonce[0] = (uint32_t)index;
+   pool->state->cc.nonce[1] = (uint32_t)(index >> 32);
+   pool->state->cc.counter = 0;
+   pool->pos = pool->len = 0;
+}
+
+static inline unsigned pool_byte(Pool * pool)
+{
+   if (pool->pos == pool->len)
+      pool_refill(pool);
+   return pool->buf[pool->pos++];
+}
+
+// bytes actually taken from the pool so far
+unsigned long long pool_used(const Pool * pool)
+{
+   return pool->bytesIn - (pool->len - pool->pos);
+}
+
+void sampler_init(Sampler * smp, const char * chars, unsigned size)
+{
+   unsigned i;
+
+   smp->chars = chars;
+   smp->size = size;
+   smp->wide = size > 256;
+   if (!size)
+   {
+      smp->limit = 0;
+      smp->simdOk = 0;
+      memset(smp->map, 0, sizeof(smp->map));
+      return;
+   }
+   smp->limit = smp->wide ? 65536 - 65536 % size : 256 - 256 % size;
+
+   for (i = 0; i < 256; i++)
+      smp->map[i] = (!smp->wide && i < smp->limit) ? chars[i % size] : 0;
+
+   smp->recip = smp->wide ? 0 : 65536 / size + 1;
+   smp->simdOk = !smp->wide;
+   for (i = 0; i < 256 && smp->simdOk; i++)
+      smp->simdOk = ((i * smp->recip) >> 16) == i / size;
+}
+
+// draw one character from a wide charset, rejecting values that would
+// bias the result
+static inline char sample_char(const Sampler * smp, Pool * pool)
+{
+   unsigned r;
+
+   do
+   {
+      r = pool_byte(pool);
+      if (smp->wide)
+         r |= pool_byte(pool) << 8;
+   } while (r >= smp->limit);
+
+   return smp->chars[r % smp->size];
+}
+
+size_t map_scalar(const Sampler * smp,
+                  const unsigned char * in, size_t n, char * out)
+{
+   const unsigned char * map = smp->map;
+   size_t i, k = 0;
+
+   for (i = 0; i < n; i++)
+   {
+      out[k] = map[in[i]];
+      k += out[k] != 0;
+   }
+   return k;
+}
+
+#ifdef HAVE_X86_SIMD
+// byte offsets of the set bits of each 8 bit mask, for packing, and how
+// many bits are set (__builtin_popcount is a libgcc call without -mpopcnt)
+uint64_t packTable[256];
+unsigned char popTable[256];
+
+void init_pack_table()
+{
+   unsigned m, b;
+
+   for (m = 0; m < 256; m++)
+   {
+      uint64_t idx = 0;
+      unsigned k = 0;
+
+      for (b = 0; b < 8; b++)
+         if (m & (1 << b))
+            idx |= (uint64_t)b << (8 * k++);
+      for (; k < 8; k++)
+         idx |= (uint64_t)0x80 << (8 * k);
+      packTable[m] = idx;
+      popTable[m] = __builtin_popcount(m);
+   }
+}
+
+/* The SIMD kernels work out r = b % size with a 16 bit multiply by the
+ * reciprocal, look chars[r] up 16 entries at a time with shuffles (map[r]
+ * is chars[r] for r < size), zero anything at or above the limit and then
+ * pack the survivors down 8 bytes at a time using packTable. */
+
+// pack the non zero bytes of v to out, returns the new end of out
+__attribute__((target("ssse3")))
+static inline char * pack16(__m128i v, char * out)
+{
+   unsigned keep = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+                   & 0xFFFF;
+   __m128i shuf = _mm_set_epi64x(packTable[keep >> 8] + 0x0808080808080808ULL,
+                                 packTable[keep & 0xFF]);
+
+   v = _mm_shuffle_epi8(v, shuf);
+   _mm_storel_epi64((__m128i *)out, v);
+   out += popTable[keep & 0xFF];
+   _mm_storel_epi64((__m128i *)out, _mm_unpackhi_epi64(v, v));
+   return out + popTable[keep >> 8];
+}
+
+__attribute__((target("ssse3")))
+size_t map_ssse3(const Sampler * smp,
+                 const unsigned char * in, size_t n, char * out)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i nib = _mm_set1_epi8(0x0F);
+   const __m128i recip = _mm_set1_epi16(smp->recip);
+   const __m128i size = _mm_set1_epi16(smp->size);
+   const __m128i top = _mm_set1_epi8((char)(smp->limit - 1));
+   unsigned ntables = (smp->size + 15) / 16;
+   __m128i tables[16];
+   char * start = out;
+   size_t i;
+   unsigned k;
+
+   for (k = 0; k < ntables; k++)
+      tables[k] = _mm_loadu_si128((const __m128i *)(smp->map + 16 * k));
+
+   for (i = 0; i + 16 <= n; i += 16)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+      __m128i r, rlo, rhi, res = zero;
+
+      lo = _mm_sub_epi16(lo, _mm_mullo_epi16(_mm_mulhi_epu16(lo, recip), size));
+      hi = _mm_sub_epi16(hi, _mm_mullo_epi16(_mm_mulhi_epu16(hi, recip), size));
+      r = _mm_packus_epi16(lo, hi);
+      rlo = _mm_and_si128(r, nib);
+      rhi = _mm_and_si128(_mm_srli_epi16(r, 4), nib);
+
+#pragma GCC unroll 16
+      for (k = 0; k < ntables; k++)
+         res = _mm_or_si128(res, _mm_and_si128(
+                  _mm_cmpeq_epi8(rhi, _mm_set1_epi8(k)),
+                  _mm_shuffle_epi8(tables[k], rlo)));
+
+      // reject b > limit - 1
+      res = _mm_and_si128(res, _mm_cmpeq_epi8(_mm_min_epu8(v, top), v));
+      out = pack16(res, out);
+   }
+
+   return (out - start) + map_scalar(smp, in + i, n - i, out);
+}
+
+__attribute__((target("avx2")))
+size_t map_avx2(const Sampler * smp,
+                const unsigned char * in, size_t n, char * out)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i nib = _mm256_set1_epi8(0x0F);
+   const __m256i recip = _mm256_set1_epi16(smp->recip);
+   const __m256i size = _mm256_set1_epi16(smp->size);
+   const __m256i top = _mm256_set1_epi8((char)(smp->limit - 1));
+   unsigned ntables = (smp->size + 15) / 16;
+   __m256i tables[16];
+   char * start = out;
+   size_t i;
+   unsigned k;
+
+   for (k = 0; k < ntables; k++)
+      tables[k] = _mm256_broadcastsi128_si256(
+                     _mm_loadu_si128((const __m128i *)(smp->map + 16 * k)));
+
+   for (i = 0; i + 32 <= n; i += 32)
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+      __m256i lo = _mm256_unpacklo_epi8(v, zero);
+      __m256i hi = _mm256_unpackhi_epi8(v, zero);
+      __m256i r, rlo, rhi, res = zero;
+
+      // unpack/pack both work within 128 bit lanes, so r stays in order
+      lo = _mm256_sub_epi16(lo,
+              _mm256_mullo_epi16(_mm256_mulhi_epu16(lo, recip), size));
+      hi = _mm256_sub_epi16(hi,
+              _mm256_mullo_epi16(_mm256_mulhi_epu16(hi, recip), size));
+      r = _mm256_packus_epi16(lo, hi);
+      rlo = _mm256_and_si256(r, nib);
+      rhi = _mm256_and_si256(_mm256_srli_epi16(r, 4), nib);
+
+#pragma GCC unroll 16
+      for (k = 0; k < ntables; k++)
+         res = _mm256_or_si256(res, _mm256_and_si256(
+                  _mm256_cmpeq_epi8(rhi, _mm256_set1_epi8(k)),
+                  _mm256_shuffle_epi8(tables[k], rlo)));
+
+      res = _mm256_and_si256(res,
+               _mm256_cmpeq_epi8(_mm256_min_epu8(v, top), v));
+      out = pack16(_mm256_castsi256_si128(res), out);
+      out = pack16(_mm256_extracti128_si256(res, 1), out);
+   }
+
+   return (out - start) + map_scalar(smp, in + i, n - i, out);
+}
+#endif
+
+MapKernel choose_kernel(int forceScalar)
+{
+#ifdef HAVE_X86_SIMD
+   init_pack_table();
+   if (forceScalar)
+      return map_scalar;
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+      return map_avx2;
+   if (__builtin_cpu_supports("ssse3"))
+      return map_ssse3;
+#endif
+   (void)forceScalar;
+   return map_scalar;
+}
+
+MapKernel mapKernel = map_scalar;
+
+static inline unsigned pool_u16(Pool * pool)
+{
+   unsigned r = pool_byte(pool);
+   return r | pool_byte(pool) << 8;
+}
+
+static inline uint32_t pool_u32(Pool * pool)
+{
+   uint32_t r = pool_u16(pool);
+   return r | (uint32_t)pool_u16(pool) << 16;
+}
+
+// as pool_uniform, for any 32 bit bound
+static inline uint32_t pool_uniform32(Pool * pool, uint32_t bound)
+{
+   uint64_t m = (uint64_t)pool_u32(pool) * bound;
+
+   if ((uint32_t)m < bound)
+   {
+      uint32_t t = -bound % bound;
+      while ((uint32_t)m < t)
+         m = (uint64_t)pool_u32(pool) * bound;
+   }
+   return m >> 32;
+}
+
+// uniform integer below bound (at most 65536), from 16 bits of the pool;
+// multiply and shift, only dividing when a reject is possible (Lemire)
+static inline unsigned pool_uniform(Pool * pool, unsigned bound)
+{
+   uint32_t m = pool_u16(pool) * bound;
+
+   if ((m & 0xFFFF) < bound)
+   {
+      uint32_t t = (65536 - bound) % bound;
+      while ((m & 0xFFFF) < t)
+         m = pool_u16(pool) * bound;
+   }
+   return m >> 16;
+}
+
+// uniform fraction below 2^32 - 1, so it is always below a cdf of 1
+static inline uint32_t pool_fraction(Pool * pool)
+{
+   uint32_t u;
+
+   while ((u = pool_u32(pool)) == UINT32_MAX)
+      ;
+   return u;
+}
+
+// copy n characters from the stream to dst, mapping whole pools as needed
+static inline void draw_chars(const Sampler * smp, Pool * pool, CharStream * cs,
+                char * dst, size_t n)
+{
+   if (smp->wide)
+   {
+      while (n--)
+         *dst++ = sample_char(smp, pool);
+      return;
+   }
+
+   if (n == 1 && cs->pos < cs->len)
+   {
+      *dst = cs->buf[cs->pos++];
+      return;
+   }
+
+   while (n)
+   {
+      size_t take = cs->len - cs->pos;
+
+      if (!take)
+      {
+         if (pool->pos == pool->len)
+            pool_refill(pool);
+         cs->inLen = pool->len - pool->pos;
+         cs->len = (smp->simdOk ? mapKernel : map_scalar)(smp,
+                      pool->buf + pool->pos, pool->len - pool->pos, cs->buf);
+         cs->pos = 0;
+         pool->pos = pool->len;
+         continue;
+      }
+      if (take > n)
+         take = n;
+      memcpy(dst, cs->buf + cs->pos, take);
+      cs->pos += take;
+      dst += take;
+      n -= take;
+   }
+}
+
+int char_class(unsigned char c)
+{
+   if (c >= 'a' && c <= 'z') return CLASS_LOWER;
+   if (c >= 'A' && c <= 'Z') return CLASS_UPPER;
+   if (c >= '0' && c <= '9') return CLASS_DIGIT;
+   return CLASS_SYMBOL;
+}
+
+// expand "a-z0-9" style ranges; a '-' at either end is taken literally
+char * expand_ranges(const char * spec)
+{
+   size_t len = strlen(spec), i, n = 0;
+   char * out = malloc(len * 256 + 1);
+
+   if (!out)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for (i = 0; i < len; i++)
+   {
+      if (i + 2 < len && spec[i + 1] == '-')
+      {
+         unsigned c, lo = (unsigned char)spec[i], hi = (unsigned char)spec[i + 2];
+         for (c = lo; c <= hi; c++)
+            out[n++] = c;
+         i += 2;
+      }
+      else
+         out[n++] = spec[i];
+   }
+   out[n] = '\0';
+   return out;
+}
+
+// copy the characters of chars not in exclude and in class cls
+char * filter_chars(const char * chars, const char * exclude, int cls)
+{
+   char * out = malloc(strlen(chars) + 1);
+   size_t n = 0;
+
+   if (!out)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+   for (; *chars; chars++)
+   {
+      if (exclude && strchr(exclude, *chars))
+         continue;
+      if (cls == CLASS_ALPHA && char_class(*chars) > CLASS_UPPER)
+         continue;
+      if (cls >= 0 && char_class(*chars) != cls)
+         continue;
+      out[n++] = *chars;
+   }
+   out[n] = '\0';
+   return out;
+}
+
+// build the samplers for a policy; returns an error message or NULL
+static double log_add(double a, double b)
+{
+   if (a == -INFINITY)
+      return b;
+   if (b == -INFINITY)
+      return a;
+   return a > b ? a + log1p(exp(b - a)) : b + log1p(exp(a - b));
+}
+
+// log of P(k successes in n) for a share q, given log k! in lf
+static double log_binom(const double * lf, unsigned n, unsigned k, double q)
+{
+   if (k > n)
+      return -INFINITY;
+   if (q <= 0)
+      return k ? -INFINITY : 0;
+   if (q >= 1)
+      return k == n ? 0 : -INFINITY;
+   return lf[n] - lf[k] - lf[n - k] + k * log(q) + (n - k) * log1p(-q);
+}
+
+/* Can passwords of this length meet the policy? Long passwords are only
+ * ever redrawn until they do, so refuse if that would often fail (by the
+ * union bound over the classes falling short) */
+const char * policy_check(const Policy * pol, unsigned length)
+{
+   static char err[128];
+   unsigned n = length - (pol->firstAlpha ? 1 : 0);
+   double fail = 0;
+   int c;
+
+   if (pol->required + (pol->firstAlpha ? 1 : 0) > length)
+      return "more characters required than the password length";
+   if (!pol->required || length <= COMPMAX)
+      return NULL;
+
+   for (c = 0; c < NCLASSES; c++)
+   {
+      double q = (double)pol->cls[c].size / pol->all.size;
+      double lp = -INFINITY;
+      unsigned k;
+
+      for (k = 0; k < pol->minClass[c]; k++)
+         lp = log_add(lp, lgamma(n + 1.0) - lgamma(k + 1.0)
+                          - lgamma(n - k + 1.0) + k * log(q)
+                          + (n - k) * log1p(-q));
+      fail += exp(lp);
+   }
+   if (fail > 0.5)
+   {
+      snprintf(err, sizeof(err), "--min* requirements too strict for "
+               "passwords over %d characters", COMPMAX);
+      return err;
+   }
+   return NULL;
+}
+
+static uint64_t sat_add(uint64_t a, uint64_t b)
+{
+   return a + b < a ? UINT64_MAX : a + b;
+}
+
+static uint64_t sat_mul(uint64_t a, uint64_t b)
+{
+   return b && a > UINT64_MAX / b ? UINT64_MAX : a * b;
+}
+
+// strings of n characters with at least min[c] of each class, which has
+// size[c] characters (saturating)
+static uint64_t count_strings(const uint64_t * size, const unsigned * min,
+                              unsigned n)
+{
+   uint64_t * ways = malloc((n + 1) * sizeof(uint64_t));
+   uint64_t * next = malloc((n + 1) * sizeof(uint64_t));
+   uint64_t * choose = malloc((n + 1) * sizeof(uint64_t));
+   uint64_t * power = malloc((n + 1) * sizeof(uint64_t));
+   uint64_t total;
+   unsigned r, k;
+   int c;
+
+   if (!ways || !next || !choose || !power)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   // ways[r]: strings of r characters from the classes so far
+   for (r = 0, total = 1; r <= n; r++, total = sat_mul(total, size[NCLASSES - 1]))
+      ways[r] = r >= min[NCLASSES - 1] ? total : 0;
+
+   for (c = NCLASSES - 2; c >= 0; c--)
+   {
+      for (k = 0, total = 1; k <= n; k++, total = sat_mul(total, size[c]))
+         power[k] = total;
+      for (r = 0; r <= n; r++)
+      {
+         // choose[] is row r of Pascal's triangle
+         choose[r] = 1;
+         for (k = r ? r - 1 : 0; k > 0; k--)
+            choose[k] = sat_add(choose[k], choose[k - 1]);
+
+         next[r] = 0;
+         for (k = min[c]; k <= r; k++)
+            next[r] = sat_add(next[r], sat_mul(sat_mul(choose[k], power[k]),
+                                               ways[r - k]));
+      }
+      memcpy(ways, next, (n + 1) * sizeof(uint64_t));
+   }
+   total = ways[n];
+   free(ways);
+   free(next);
+   free(choose);
+   free(power);
+   return total;
+}
+
+// chance that n characters, each in class c with probability share[c],
+// have at least min[c] of every class; count_strings with shares
+static double pass_chance(const double * share, const unsigned * min,
+                          unsigned n)
+{
+   double * ways = malloc((n + 1) * sizeof(double));
+   double * next = malloc((n + 1) * sizeof(double));
+   double * choose = malloc((n + 1) * sizeof(double));
+   double * power = malloc((n + 1) * sizeof(double));
+   double total;
+   unsigned r, k;
+   int c;
+
+   if (!ways || !next || !choose || !power)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for (r = 0, total = 1; r <= n; r++, total *= share[NCLASSES - 1])
+      ways[r] = r >= min[NCLASSES - 1] ? total : 0;
+
+   for (c = NCLASSES - 2; c >= 0; c--)
+   {
+      for (k = 0, total = 1; k <= n; k++, total *= share[c])
+         power[k] = total;
+      for (r = 0; r <= n; r++)
+      {
+         choose[r] = 1;
+         for (k = r ? r - 1 : 0; k > 0; k--)
+            choose[k] += choose[k - 1];
+
+         next[r] = 0;
+         for (k = min[c]; k <= r; k++)
+            next[r] += choose[k] * power[k] * ways[r - k];
+      }
+      memcpy(ways, next, (n + 1) * sizeof(double));
+   }
+   total = ways[n];
+   free(ways);
+   free(next);
+   free(choose);
+   free(power);
+   return total;
+}
+
+/* Chance that a password drawn from the whole charset (the first character
+ * from the letters for --firstalpha) meets the policy as it is */
+static double policy_pass_chance(const Policy * pol, unsigned length)
+{
+   double share[NCLASSES], chance = 0;
+   unsigned min[NCLASSES];
+   int c;
+
+   for (c = 0; c < NCLASSES; c++)
+      share[c] = (double)pol->cls[c].size / pol->all.size;
+   if (!pol->firstAlpha)
+      return pass_chance(share, pol->minClass, length);
+
+   for (c = CLASS_LOWER; c <= CLASS_UPPER; c++)
+   {
+      memcpy(min, pol->minClass, sizeof(min));
+      if (min[c])
+         min[c]--;
+      chance += (double)pol->cls[c].size / pol->alpha.size
+                * pass_chance(share, min, length - 1);
+   }
+   return chance;
+}
+
+/* How many different passwords of length meet the policy, given how many
+ * different characters each class has; UINT64_MAX if that many or more.
+ * policy_check makes sure most long ones qualify, so there are plenty */
+uint64_t policy_count(const Policy * pol, const uint64_t * size,
+                      unsigned length)
+{
+   unsigned min[NCLASSES];
+   uint64_t total = 0;
+   int c;
+
+   if (length > COMPMAX)
+      return UINT64_MAX;
+   if (!pol->firstAlpha)
+      return count_strings(size, pol->minClass, length);
+
+   for (c = CLASS_LOWER; c <= CLASS_UPPER; c++)
+   {
+      memcpy(min, pol->minClass, sizeof(min));
+      if (min[c])
+         min[c]--;
+      total = sat_add(total, sat_mul(size[c],
+                                     count_strings(size, min, length - 1)));
+   }
+   return total;
+}
+
+const char * policy_compile(Policy * pol, const char * chars,
+                            const char * exclude, unsigned length)
+{
+   static const char * className[NCLASSES] =
+      { "lowercase", "uppercase", "digit", "symbol" };
+   static char err[128];
+   char * all = filter_chars(chars, exclude, CLASS_ANY);
+   char * sub;
+   size_t size = strlen(all);
+   int c;
+
+   if (size < 2 || size > MAXCHARS)
+      return "need between 2 and 65536 characters";
+   sampler_init(&pol->all, all, size);
+
+   sub = filter_chars(all, NULL, CLASS_ALPHA);
+   if (pol->firstAlpha && !*sub)
+      return "--firstalpha but the charset has no letters";
+   sampler_init(&pol->alpha, sub, strlen(sub));
+
+   for (c = 0; c < 256; c++)
+      pol->classOf[c] = char_class(c);
+
+   pol->required = 0;
+   for (c = 0; c < NCLASSES; c++)
+   {
+      sub = filter_chars(all, NULL, c);
+      if (pol->minClass[c] && !*sub)
+      {
+         snprintf(err, sizeof(err), "charset has no %s characters",
+                  className[c]);
+         return err;
+      }
+      sampler_init(&pol->cls[c], sub, strlen(sub));
+      pol->required += pol->minClass[c];
+   }
+
+   return policy_check(pol, length);
+}
+
+void policy_streams_init(PolicyStreams * ps)
+{
+   memset(ps, 0, sizeof(*ps));
+}
+
+// pool bytes behind characters mapped but not used yet, pro rata
+static unsigned long long stream_unused(const CharStream * cs)
+{
+   return cs->len
+      ? (unsigned long long)(cs->len - cs->pos) * cs->inLen / cs->len : 0;
+}
+
+unsigned long long policy_streams_unused(const PolicyStreams * ps)
+{
+   unsigned long long bytes = stream_unused(&ps->all)
+                              + stream_unused(&ps->alpha);
+   unsigned c;
+
+   for (c = 0; c < NCLASSES; c++)
+      bytes += stream_unused(&ps->cls[c]);
+   return bytes;
+}
+
+// forget any characters already mapped
+void policy_streams_reset(PolicyStreams * ps)
+{
+   unsigned c;
+
+   ps->all.pos = ps->all.len = 0;
+   ps->alpha.pos = ps->alpha.len = 0;
+   for (c = 0; c < NCLASSES; c++)
+      ps->cls[c].pos = ps->cls[c].len = 0;
+}
+
+static void * comp_alloc(void * old, size_t size)
+{
+   void * a = realloc(old, size);
+
+   if (!a)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+   return a;
+}
+
+void composition_free(Composition * comp)
+{
+   unsigned step, p;
+
+   for (step = 0; step < 3; step++)
+   {
+      if (comp->cdf[step])
+         for (p = 0; p <= comp->length; p++)
+            free(comp->cdf[step][p]);
+      free(comp->cdf[step]);
+      comp->cdf[step] = NULL;
+   }
+   free(comp->lf);
+   free(comp->rest);
+   free(comp->letters);
+   free(comp->joint);
+   free(comp->split);
+   comp->lf = comp->rest = comp->letters = NULL;
+   comp->joint = comp->split = NULL;
+   comp->splits = comp->length = 0;
+}
+
+// log of size^k, where 0^0 is 1
+static double log_power(double size, unsigned k)
+{
+   return k ? k * log(size) : 0;
+}
+
+/* Short passwords have few enough splits to pick one outright, from one
+ * draw instead of one per class */
+static void composition_joint(Composition * comp, const Policy * pol)
+{
+   const unsigned * m = pol->minClass;
+   unsigned n = comp->length, most = (n + 1) * (n + 2) * (n + 3) / 6;
+   double * w = comp_alloc(NULL, most * sizeof(double));
+   double total = -INFINITY, sum = 0;
+   unsigned d, s, l, u, i;
+
+   comp->split = comp_alloc(NULL, most * sizeof(uint32_t));
+   for (d = m[CLASS_DIGIT]; d <= n; d++)
+      for (s = m[CLASS_SYMBOL]; d + s <= n; s++)
+         for (l = m[CLASS_LOWER]; d + s + l + m[CLASS_UPPER] <= n; l++)
+         {
+            double x;
+
+            u = n - d - s - l;
+            x = -comp->lf[d] - comp->lf[s] - comp->lf[l] - comp->lf[u]
+                + log_power(pol->cls[CLASS_DIGIT].size, d)
+                + log_power(pol->cls[CLASS_SYMBOL].size, s)
+                + log_power(pol->cls[CLASS_LOWER].size, l)
+                + log_power(pol->cls[CLASS_UPPER].size, u);
+            if (pol->firstAlpha)
+               x += log(l + u);
+            if (x == -INFINITY)
+               continue;
+            w[comp->splits] = x;
+            comp->split[comp->splits++] = d | s << 10 | l << 20;
+            total = log_add(total, x);
+         }
+
+   comp->joint = comp_alloc(NULL, comp->splits * sizeof(uint32_t));
+   for (i = 0; i < comp->splits; i++)
+   {
+      sum += exp(w[i] - total);
+      comp->joint[i] = sum >= 1 ? UINT32_MAX
+                                : (uint32_t)(sum * UINT32_MAX + 0.5);
+   }
+   comp->joint[comp->splits - 1] = UINT32_MAX;
+   free(w);
+}
+
+/* Fill in the tables for passwords of length characters. The weight of a
+ * split is the number of passwords with it: a multinomial coefficient
+ * times the class sizes to the power of their counts, which is worked out
+ * as the chance of that split among uniformly drawn passwords. With
+ * --firstalpha only t/length of them start with a letter */
+void composition_init(Composition * comp, const Policy * pol, unsigned length)
+{
+   const unsigned * m = pol->minClass;
+   double sd = pol->cls[CLASS_DIGIT].size, ss = pol->cls[CLASS_SYMBOL].size;
+   double sl = pol->cls[CLASS_LOWER].size, su = pol->cls[CLASS_UPPER].size;
+   unsigned n = length, step, k, r, t;
+
+   composition_free(comp);
+   comp->length = n;
+   comp->lf = comp_alloc(NULL, (n + 1) * sizeof(double));
+   comp->rest = comp_alloc(NULL, (n + 1) * sizeof(double));
+   comp->letters = comp_alloc(NULL, (n + 1) * sizeof(double));
+   for (step = 0; step < 3; step++)
+   {
+      comp->cdf[step] = comp_alloc(NULL, (n + 1) * sizeof(uint32_t *));
+      memset(comp->cdf[step], 0, (n + 1) * sizeof(uint32_t *));
+   }
+
+   comp->q[0] = sd / (sd + ss + sl + su);
+   comp->q[1] = ss + sl + su > 0 ? ss / (ss + sl + su) : 0;
+   comp->q[2] = sl + su > 0 ? sl / (sl + su) : 0;
+   for (k = 0; k <= n; k++)
+      comp->lf[k] = lgamma(k + 1.0);
+
+   for (t = 0; t <= n; t++)
+   {
+      double w = -INFINITY;
+
+      if (sl + su == 0)
+         w = t ? -INFINITY : 0;
+      else
+         for (k = m[CLASS_LOWER]; k + m[CLASS_UPPER] <= t; k++)
+            w = log_add(w, log_binom(comp->lf, t, k, comp->q[2]));
+      if (pol->firstAlpha)
+         w += log(t);
+      comp->letters[t] = w;
+   }
+
+   for (r = 0; r <= n; r++)
+   {
+      double w = -INFINITY;
+
+      for (k = m[CLASS_SYMBOL]; k <= r; k++)
+         w = log_add(w, log_binom(comp->lf, r, k, comp->q[1])
+                        + comp->letters[r - k]);
+      comp->rest[r] = w;
+   }
+
+   if (n <= JOINTMAX)
+      composition_joint(comp, pol);
+
+   //a plain draw is cheaper than the tables, but only worth it if it
+   //usually passes
+   comp->drawAll = policy_pass_chance(pol, n) >= DRAWALLCHANCE;
+}
+
+// log weight of k characters of the step's class with p places left
+static double comp_weight(const Composition * comp, const Policy * pol,
+                          unsigned step, unsigned p, unsigned k)
+{
+   const unsigned * m = pol->minClass;
+
+   switch (step)
+   {
+   case 0:
+      return k < m[CLASS_DIGIT] ? -INFINITY
+         : log_binom(comp->lf, p, k, comp->q[0]) + comp->rest[p - k];
+   case 1:
+      return k < m[CLASS_SYMBOL] ? -INFINITY
+         : log_binom(comp->lf, p, k, comp->q[1]) + comp->letters[p - k];
+   default:
+      return k < m[CLASS_LOWER] || k + m[CLASS_UPPER] > p ? -INFINITY
+         : log_binom(comp->lf, p, k, comp->q[2]);
+   }
+}
+
+/* Pick how many of the p places left get the step's class. The chances
+ * for each p are worked out the first time it comes up and kept */
+static unsigned comp_pick(Composition * comp, const Policy * pol,
+                          Pool * pool, unsigned step, unsigned p)
+{
+   uint32_t * cdf = comp->cdf[step][p];
+   uint32_t u = pool_fraction(pool);
+   unsigned lo = 0, hi = p, k;
+
+   if (!cdf)
+   {
+      double * w = comp_alloc(NULL, (p + 1) * sizeof(double));
+      double total = -INFINITY, sum = 0;
+      unsigned last = 0;
+
+      for (k = 0; k <= p; k++)
+      {
+         w[k] = comp_weight(comp, pol, step, p, k);
+         total = log_add(total, w[k]);
+      }
+      cdf = comp_alloc(NULL, (p + 1) * sizeof(uint32_t));
+      for (k = 0; k <= p; k++)
+      {
+         double x = exp(w[k] - total);
+
+         if (x > 0)
+            last = k;
+         sum += x;
+         cdf[k] = sum >= 1 ? UINT32_MAX : (uint32_t)(sum * UINT32_MAX + 0.5);
+      }
+      for (k = last; k <= p; k++)
+         cdf[k] = UINT32_MAX;
+      free(w);
+      comp->cdf[step][p] = cdf;
+   }
+
+   while (lo < hi)
+   {
+      unsigned mid = lo + (hi - lo) / 2;
+
+      if (cdf[mid] > u)
+         hi = mid;
+      else
+         lo = mid + 1;
+   }
+   return lo;
+}
+
+// draw how many characters of each class a password gets
+void composition_draw(Composition * comp, const Policy * pol, Pool * pool,
+                      unsigned * count)
+{
+   unsigned left = comp->length;
+
+   if (comp->joint)
+   {
+      uint32_t u = pool_fraction(pool), split;
+      unsigned lo = 0, hi = comp->splits - 1;
+
+      while (lo < hi)
+      {
+         unsigned mid = lo + (hi - lo) / 2;
+
+         if (comp->joint[mid] > u)
+            hi = mid;
+         else
+            lo = mid + 1;
+      }
+      split = comp->split[lo];
+      count[CLASS_DIGIT] = split & 1023;
+      count[CLASS_SYMBOL] = split >> 10 & 1023;
+      count[CLASS_LOWER] = split >> 20 & 1023;
+      count[CLASS_UPPER] = left - count[CLASS_DIGIT] - count[CLASS_SYMBOL]
+                           - count[CLASS_LOWER];
+      return;
+   }
+
+   count[CLASS_DIGIT] = comp_pick(comp, pol, pool, 0, left);
+   left -= count[CLASS_DIGIT];
+   count[CLASS_SYMBOL] = comp_pick(comp, pol, pool, 1, left);
+   left -= count[CLASS_SYMBOL];
+   count[CLASS_LOWER] = comp_pick(comp, pol, pool, 2, left);
+   count[CLASS_UPPER] = left - count[CLASS_LOWER];
+}
+
+void policy_streams_free(PolicyStreams * ps)
+{
+   composition_free(&ps->comp);
+}
+
+/* Fisher-Yates shuffle of n characters. One 32 bit draw covers as many
+ * places as n(n-1)...(k+1) fits in: it is accepted as for pool_uniform32
+ * and each multiply by a place count then gives the next swap index in
+ * the high half, the low half carrying on (Lemire's batched method) */
+static void shuffle_chars(Pool * pool, char * s, unsigned n)
+{
+   while (n > 1)
+   {
+      uint32_t bound = n, u = pool_u32(pool);
+      unsigned k = n - 1;
+
+      while (k > 1 && bound <= UINT32_MAX / k)
+         bound *= k--;
+      if (u * bound < bound)
+      {
+         uint32_t t = -bound % bound;
+         while (u * bound < t)
+            u = pool_u32(pool);
+      }
+      for (; n > k; n--)
+      {
+         uint64_t m = (uint64_t)u * n;
+         unsigned j = m >> 32;
+         char tmp = s[n - 1];
+
+         u = m;
+         s[n - 1] = s[j];
+         s[j] = tmp;
+      }
+   }
+}
+
+/* Generate one password meeting the policy into dst, every such password
+ * being equally likely. A password is drawn from the whole charset (the
+ * first character from the letters for --firstalpha) and kept if it meets
+ * the --min* counts. Otherwise the class counts are drawn with the right
+ * weights (see composition_init), that many characters drawn from each
+ * class and shuffled; strict policies go straight to that, as the first
+ * draw would mostly be wasted. Passwords too long for the tables are just
+ * drawn again. */
+void policy_draw(const Policy * pol, Pool * pool, PolicyStreams * ps,
+                 char * dst, unsigned length)
+{
+   unsigned count[NCLASSES];
+   unsigned tries = 0, start = 0, c, k;
+
+   if (pol->required && length <= COMPMAX && ps->comp.length != length)
+      composition_init(&ps->comp, pol, length);
+
+   while (!pol->required || length > COMPMAX || ps->comp.drawAll)
+   {
+      draw_chars(&pol->all, pool, &ps->all, dst, length);
+      if (pol->firstAlpha)
+         draw_chars(&pol->alpha, pool, &ps->alpha, dst, 1);
+      if (!pol->required)
+         return;
+
+      memset(count, 0, sizeof(count));
+      for (k = 0; k < length; k++)
+         count[pol->classOf[(unsigned char)dst[k]]]++;
+      for (c = 0; c < NCLASSES && count[c] >= pol->minClass[c]; c++)
+         ;
+      if (c == NCLASSES)
+         return;
+      if (length <= COMPMAX)
+         break;
+      if (++tries == MAXRETRIES)
+      {
+         fprintf(stderr, "randompw: can't meet the --min* requirements\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   composition_draw(&ps->comp, pol, pool, count);
+
+   if (pol->firstAlpha)
+   {
+      c = pool_uniform(pool, count[CLASS_LOWER] + count[CLASS_UPPER])
+          < count[CLASS_LOWER] ? CLASS_LOWER : CLASS_UPPER;
+      count[c]--;
+      draw_chars(&pol->cls[c], pool, &ps->cls[c], dst, 1);
+      start = 1;
+   }
+
+   for (c = 0, k = start; c < NCLASSES; k += count[c++])
+      draw_chars(&pol->cls[c], pool, &ps->cls[c], dst + k, count[c]);
+   shuffle_chars(pool, dst + start, length - start);
+}
+
+// save the index next to the word list; failure just means no cache
+void wordlist_save(const char * idxPath, const WordIndexHdr * hdr,
+                   const WordRef * words)
+{
+   char * tmp = malloc(strlen(idxPath) + 16);
+   size_t len = hdr->count * sizeof(WordRef);
+   int fd, ok;
+
+   if (!tmp)
+      return;
+   sprintf(tmp, "%s.%d", idxPath, (int)getpid());
+   // never follow or reuse whatever is already at that name
+   fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+   if (fd < 0)
+   {
+      free(tmp);
+      return;
+   }
+   ok = write(fd, hdr, sizeof(*hdr)) == sizeof(*hdr)
+        && write(fd, words, len) == (ssize_t)len;
+   ok = (close(fd) == 0) && ok;
+   if (!ok || rename(tmp, idxPath) != 0)
+      unlink(tmp);
+   free(tmp);
+}
+
+// map a word list and its index, building the index if it is missing or
+// stale; returns an error message or NULL
+const char * wordlist_open(WordList * wl, const char * path)
+{
+   static char err[256];
+   char * idxPath;
+   struct stat st, ist;
+   WordIndexHdr hdr;
+   WordRef * words = NULL;
+   uint32_t size = 0, start;
+   int fd, ifd;
+
+   fd = open(path, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) != 0)
+   {
+      snprintf(err, sizeof(err), "can't open word list %s", path);
+      return err;
+   }
+   if (st.st_size == 0 || (uint64_t)st.st_size > UINT32_MAX)
+   {
+      snprintf(err, sizeof(err), "word list %s is empty or too big", path);
+      return err;
+   }
+   wl->text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (wl->text == MAP_FAILED)
+   {
+      snprintf(err, sizeof(err), "can't map word list %s", path);
+      return err;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, IDXMAGIC, sizeof(hdr.magic));
+   hdr.dev = st.st_dev;
+   hdr.ino = st.st_ino;
+   hdr.size = st.st_size;
+   hdr.mtime = st.st_mtime;
+   hdr.ctime = st.st_ctime;
+
+   idxPath = malloc(strlen(path) + strlen(IDXEXT) + 1);
+   if (!idxPath)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+   sprintf(idxPath, "%s%s", path, IDXEXT);
+
+   // use the saved index if it matches the list
+   ifd = open(idxPath, O_RDONLY);
+   if (ifd >= 0 && fstat(ifd, &ist) == 0
+       && (size_t)ist.st_size >= sizeof(hdr))
+   {
+      const WordIndexHdr * saved = mmap(NULL, ist.st_size, PROT_READ,
+                                        MAP_PRIVATE, ifd, 0);
+      if (saved != MAP_FAILED)
+      {
+         if (memcmp(saved->magic, hdr.magic, sizeof(hdr.magic)) == 0
+             && saved->dev == hdr.dev && saved->ino == hdr.ino
+             && saved->size == hdr.size && saved->mtime == hdr.mtime
+             && saved->ctime == hdr.ctime
+             && (size_t)ist.st_size
+                == sizeof(hdr) + (size_t)saved->count * sizeof(WordRef)
+             && saved->maxLen <= saved->size)
+         {
+            // the words themselves are only checked as they are drawn
+            wl->words = (const WordRef *)(saved + 1);
+            wl->size = saved->size;
+            wl->count = saved->count;
+            wl->maxLen = saved->maxLen;
+            close(ifd);
+            free(idxPath);
+            return wl->count < 2 ? "word list has fewer than 2 words" : NULL;
+         }
+         munmap((void *)saved, ist.st_size);
+      }
+   }
+   if (ifd >= 0)
+      close(ifd);
+
+   // build it: the last whitespace separated token of each line
+   for (start = 0; start < hdr.size; )
+   {
+      uint32_t end = start, wend, wstart;
+
+      while (end < hdr.size && wl->text[end] != '\n')
+         end++;
+      wend = end;
+      while (wend > start && strchr(" \t\r", wl->text[wend - 1]))
+         wend--;
+      wstart = wend;
+      while (wstart > start && !strchr(" \t", wl->text[wstart - 1]))
+         wstart--;
+
+      if (wend > wstart)
+      {
+         if (hdr.count == size)
+         {
+            size = size ? size * 2 : 4096;
+            words = realloc(words, size * sizeof(WordRef));
+            if (!words)
+            {
+               fprintf(stderr, "Out of memory!\n");
+               exit(EXIT_FAILURE);
+            }
+         }
+         words[hdr.count].off = wstart;
+         words[hdr.count].len = wend - wstart;
+         if (wend - wstart > hdr.maxLen)
+            hdr.maxLen = wend - wstart;
+         hdr.count++;
+      }
+      start = end + 1;
+   }
+
+   //don't save an index for a list modified this second, it could change
+   //again without its mtime changing
+   if (hdr.count >= 2 && st.st_mtime < time(NULL) && st.st_ctime < time(NULL))
+      wordlist_save(idxPath, &hdr, words);
+   free(idxPath);
+
+   wl->words = words;
+   wl->size = hdr.size;
+   wl->count = hdr.count;
+   wl->maxLen = hdr.maxLen;
+   return wl->count < 2 ? "word list has fewer than 2 words" : NULL;
+}
+
+// one passphrase into dst, returns its length
+size_t draw_phrase(const Job * job, Pool * pool, PolicyStreams * ps,
+                   char * dst)
+{
+   const WordList * wl = job->wordList;
+   size_t sepLen = job->sep ? strlen(job->sep) : 1;
+   char * p = dst;
+   unsigned w;
+
+   for (w = 0; w < job->nwords; w++)
+   {
+      const WordRef * ref = &wl->words[pool_uniform32(pool, wl->count)];
+
+      // a saved index is trusted only this far; it could be damaged or
+      // edited while it is in use
+      if (!ref->len || ref->len > wl->maxLen
+          || (uint64_t)ref->off + ref->len > wl->size)
+      {
+         fprintf(stderr, "randompw: word list index is corrupt\n");
+         exit(EXIT_FAILURE);
+      }
+
+      if (w && job->sep)
+      {
+         memcpy(p, job->sep, sepLen);
+         p += sepLen;
+      }
+      else if (w)
+         draw_chars(&job->policy->all, pool, &ps->all, p++, 1);
+
+      memcpy(p, wl->text + ref->off, ref->len);
+      p += ref->len;
+   }
+   return p - dst;
+}
+
+// keyspace of length characters from chars (distinct characters only);
+// 0 if it doesn't fit in 64 bits
+uint64_t keyspace(UniqueSet * set, const char * chars, unsigned length)
+{
+   uint64_t space = 1;
+   unsigned i;
+
+   memset(set->digit, 0xFF, sizeof(set->digit));
+   set->base = 0;
+   for (; *chars; chars++)
+      if (set->digit[(unsigned char)*chars] == 0xFF)
+      {
+         set->symbol[set->base] = *chars;
+         set->digit[(unsigned char)*chars] = set->base++;
+      }
+
+   for (i = 0; i < length; i++)
+   {
+      if (space > UINT64_MAX / set->base)
+         return 0;
+      space *= set->base;
+   }
+   return space;
+}
+
+/* Once most keys are used, drawing at random mostly finds used ones; a
+ * dense set instead picks the r-th free key, finding its block of the
+ * bitmap from a Fenwick tree of free counts. Keys are taken by setting
+ * their bit atomically and only then taking them off the counts, so the
+ * counts never say there are fewer free keys than there are */
+static void unique_dense_init(UniqueSet * set, uint64_t space)
+{
+   size_t words = space / 64 + 1, i;
+
+   // keys past the end of the keyspace are never free
+   set->bits[space / 64] |= ~0ULL << (space % 64);
+   set->freeKeys = space;
+   set->words = words;
+   set->blocks = (words + BLOCKWORDS - 1) / BLOCKWORDS;
+   set->tree = calloc(set->blocks + 1, sizeof(uint64_t));
+   if (!set->tree)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 1; i <= set->blocks; i++)
+   {
+      uint64_t last = i * BLOCKWORDS * 64;
+      size_t up = i + (i & -i);
+
+      set->tree[i] += (last < space ? last : space) - (i - 1) * BLOCKWORDS * 64;
+      if (up <= set->blocks)
+         set->tree[up] += set->tree[i];
+   }
+   pthread_mutex_init(&set->denseLock, NULL);
+   set->dense = 1;
+}
+
+// take key k out of a dense set; returns 0 if it was already taken
+static int unique_dense_take(UniqueSet * set, uint64_t k)
+{
+   uint64_t bit = 1ULL << (k & 63);
+   size_t i;
+
+   if (__atomic_fetch_or(&set->bits[k >> 6], bit, __ATOMIC_RELAXED) & bit)
+      return 0;
+   for (i = (k >> 6) / BLOCKWORDS + 1; i <= set->blocks; i += i & -i)
+      __atomic_fetch_sub(&set->tree[i], 1, __ATOMIC_RELAXED);
+   __atomic_fetch_sub(&set->freeKeys, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&set->added, 1, __ATOMIC_RELAXED);
+   return 1;
+}
+
+// plain: every key is a valid password, so free keys can be picked directly
+void unique_init(UniqueSet * set, uint64_t space, unsigned length,
+                 unsigned long long count, int plain)
+{
+   size_t size = 64;
+   unsigned i;
+
+   set->packed = space != 0;
+   set->length = length;
+   set->keyLen = set->packed ? 8 : length;
+   set->bitmap = set->packed && space <= BITMAPMAX
+                 && (space <= (1 << 26) || space / 8 <= count * 16);
+   if (set->bitmap)
+   {
+      set->bits = calloc(space / 64 + 1, sizeof(uint64_t));
+      if (!set->bits)
+      {
+         fprintf(stderr, "Out of memory!\n");
+         exit(EXIT_FAILURE);
+      }
+      if (plain && count > space / 2)
+         unique_dense_init(set, space);
+      return;
+   }
+
+   // start each shard between 35% and 70% full
+   while (size * 7 < (count / NSHARDS + 1) * 10)
+      size *= 2;
+   for (i = 0; i < NSHARDS; i++)
+   {
+      pthread_mutex_init(&set->shard[i].lock, NULL);
+      set->shard[i].size = size;
+      set->shard[i].used = 0;
+      set->shard[i].slots = calloc(size, set->keyLen);
+      if (!set->shard[i].slots)
+      {
+         fprintf(stderr, "Out of memory!\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+static inline uint64_t hash_key(const unsigned char * key, unsigned len)
+{
+   uint64_t h = 14695981039346656037ULL;  //FNV-1a, then a final mix
+
+   while (len--)
+      h = (h ^ *key++) * 1099511628211ULL;
+   h ^= h >> 31;
+   h *= 0x9E3779B97F4A7C15ULL;
+   return h ^ (h >> 29);
+}
+
+static inline int slot_empty(const unsigned char * slot, unsigned len)
+{
+   while (len--)
+      if (*slot++)
+         return 0;
+   return 1;
+}
+
+// insert into a shard that has room; returns 0 if the key was there
+static int shard_insert(const UniqueSet * set, UniqueShard * sh,
+                        const unsigned char * key, uint64_t h)
+{
+   size_t mask = sh->size - 1, i;
+
+   for (i = h & mask; ; i = (i + 1) & mask)
+   {
+      unsigned char * slot = sh->slots + i * set->keyLen;
+
+      if (slot_empty(slot, set->keyLen))
+         break;
+      if (memcmp(slot, key, set->keyLen) == 0)
+         return 0;
+   }
+   memcpy(sh->slots + i * set->keyLen, key, set->keyLen);
+   sh->used++;
+   return 1;
+}
+
+// returns 1 if code hasn't been seen before (and remembers it)
+int unique_add(UniqueSet * set, const char * code)
+{
+   unsigned char packed[8];
+   const unsigned char * key = (const unsigned char *)code;
+   UniqueShard * sh;
+   uint64_t h;
+   int added;
+
+   if (set->packed)
+   {
+      uint64_t k = 0;
+      unsigned i;
+
+      for (i = set->length; i--; )
+         k = k * set->base + set->digit[(unsigned char)code[i]];
+
+      if (set->dense)
+         return unique_dense_take(set, k);
+      if (set->bitmap)
+      {
+         uint64_t bit = 1ULL << (k & 63);
+         added = !(__atomic_fetch_or(&set->bits[k >> 6], bit, __ATOMIC_RELAXED)
+                   & bit);
+         if (added)
+            __atomic_fetch_add(&set->added, 1, __ATOMIC_RELAXED);
+         return added;
+      }
+
+      k++;  // so no key is all zero
+      for (i = 0; i < 8; i++)
+         packed[i] = k >> (8 * i);
+      key = packed;
+   }
+
+   h = hash_key(key, set->keyLen);
+   sh = &set->shard[h >> (64 - SHARDBITS)];
+
+   pthread_mutex_lock(&sh->lock);
+   added = shard_insert(set, sh, key, h);
+   if (added && sh->used * 10 > sh->size * 7)
+   {
+      UniqueShard old = *sh;
+      size_t i;
+
+      sh->size *= 2;
+      sh->used = 0;
+      sh->slots = calloc(sh->size, set->keyLen);
+      if (!sh->slots)
+      {
+         fprintf(stderr, "Out of memory!\n");
+         exit(EXIT_FAILURE);
+      }
+      for (i = 0; i < old.size; i++)
+      {
+         const unsigned char * slot = old.slots + i * set->keyLen;
+         if (!slot_empty(slot, set->keyLen))
+            shard_insert(set, sh, slot, hash_key(slot, set->keyLen));
+      }
+      free(old.slots);
+   }
+   pthread_mutex_unlock(&sh->lock);
+   if (added)
+      __atomic_fetch_add(&set->added, 1, __ATOMIC_RELAXED);
+   return added;
+}
+
+// uniform below bound, for any 64 bit bound
+static uint64_t pool_uniform64(Pool * pool, uint64_t bound)
+{
+   uint64_t mask = bound - 1, r;
+
+   mask |= mask >> 1;  mask |= mask >> 2;  mask |= mask >> 4;
+   mask |= mask >> 8;  mask |= mask >> 16; mask |= mask >> 32;
+   do
+   {
+      r = pool_u32(pool);
+      r = (r | (uint64_t)pool_u32(pool) << 32) & mask;
+   } while (r >= bound);
+   return r;
+}
+
+// a dense set had code already: replace it with a free key, every free
+// key being equally likely. Other threads may take keys meanwhile, which
+// only leaves the counts briefly too high; the pick is then made again
+void unique_pick(UniqueSet * set, Pool * pool, char * code)
+{
+   uint64_t r, word = 0, k;
+   size_t block, step, w, end;
+   unsigned i;
+
+   pthread_mutex_lock(&set->denseLock);
+   for (step = 1; step * 2 <= set->blocks; step *= 2)
+      ;
+   for (;;)
+   {
+      size_t s;
+
+      r = pool_uniform64(pool, __atomic_load_n(&set->freeKeys,
+                                               __ATOMIC_RELAXED));
+      block = 0;
+      for (s = step; s; s /= 2)
+      {
+         uint64_t n;
+
+         if (block + s > set->blocks)
+            continue;
+         n = __atomic_load_n(&set->tree[block + s], __ATOMIC_RELAXED);
+         if (n <= r)
+         {
+            block += s;
+            r -= n;
+         }
+      }
+      if (block == set->blocks)
+         continue;
+
+      end = (block + 1) * BLOCKWORDS;
+      if (end > set->words)
+         end = set->words;
+      for (w = block * BLOCKWORDS; w < end; w++)
+      {
+         unsigned n;
+
+         word = ~__atomic_load_n(&set->bits[w], __ATOMIC_RELAXED);
+         n = __builtin_popcountll(word);
+         if (r < n)
+            break;
+         r -= n;
+      }
+      if (w == end)
+         continue;
+
+      for (; r; r--)
+         word &= word - 1;
+      k = w * 64 + __builtin_ctzll(word);
+      if (unique_dense_take(set, k))
+         break;
+   }
+   pthread_mutex_unlock(&set->denseLock);
+
+   for (i = 0; i < set->length; i++, k /= set->base)
+      code[i] = set->symbol[k % set->base];
+}
+
+// repeats in a row before giving up, allowing for how few are left
+static unsigned long long unique_tries(UniqueSet * set)
+{
+   uint64_t left = set->valid
+                   - __atomic_load_n(&set->added, __ATOMIC_RELAXED);
+   double tries = MAXRETRIES + 64.0 * set->valid / (left ? left : 1);
+
+   return tries < 1e18 ? tries : 1e18;
+}
+
+// write all of buf to fd, returns -1 on error
+int write_all(int fd, const char * buf, size_t len)
+{
+   while (len)
+   {
+      ssize_t done = write(fd, buf, len);
+      if (done < 0 && errno == EINTR)
+         continue;
+      if (done < 0)
+         return -1;
+      buf += done;
+      len -= done;
+   }
+   return 0;
+}
+
+// write all of buf to stdout; whole buffers are never interleaved
+void write_out(const char * buf, size_t len)
+{
+   pthread_mutex_lock(&outLock);
+   if (write_all(STDOUT_FILENO, buf, len) < 0)
+   {
+      perror("write");
+      exit(EXIT_FAILURE);
+   }
+   pthread_mutex_unlock(&outLock);
+}
+
+// write batch number turn once every earlier batch has been written
+void write_ordered(const char * buf, size_t len, unsigned long long turn)
+{
+   pthread_mutex_lock(&outLock);
+   while (outTurn != turn)
+      pthread_cond_wait(&outTurnCond, &outLock);
+   if (write_all(STDOUT_FILENO, buf, len) < 0)
+   {
+      perror("write");
+      exit(EXIT_FAILURE);
+   }
+   outTurn++;
+   pthread_cond_broadcast(&outTurnCond);
+   pthread_mutex_unlock(&outLock);
+}
+
+// output buffer holding a whole number of the job's passwords
+char * job_buffer(const Job * job, size_t * recLen, size_t * bufLen)
+{
+   char * buf;
+
+   *recLen = job->wordList
+      ? job->nwords * (job->wordList->maxLen
+                       + (job->sep ? strlen(job->sep) : 1))
+      : job->length;
+   *recLen += job->newline ? 1 : 0;
+   *bufLen = *recLen > OUTBUFLEN ? *recLen : OUTBUFLEN - OUTBUFLEN % *recLen;
+   buf = malloc(*bufLen);
+
+   if (!buf)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+   return buf;
+}
+
+/* --seed: the job->count passwords from job->first on are split into
+ * batches of one output buffer each, and thread id makes batches id,
+ * id + threads, ... Password i is always drawn from the keystream with
+ * nonce i, so the output doesn't depend on who generated it */
+void * generate_seeded(void * arg)
+{
+   Job * job = arg;
+   RngState st;
+   Pool pool;
+   PolicyStreams ps;
+   size_t recLen, bufLen, len;
+   char * buf = job_buffer(job, &recLen, &bufLen);
+   unsigned long long perBatch = bufLen / recLen;
+   unsigned long long batch, n, end, dropped = 0;
+
+   job->charsOut = 0;
+   pool_seed(&pool, &st, job->seed);
+   policy_streams_init(&ps);
+
+   for (batch = job->id; batch * perBatch < job->count; batch += job->threads)
+   {
+      size_t used = 0;
+
+      end = (batch + 1) * perBatch;
+      if (end > job->count)
+         end = job->count;
+      for (n = batch * perBatch; n < end; n++)
+      {
+         // the rest of the last password's keystream is thrown away unused
+         dropped += pool.len - pool.pos + policy_streams_unused(&ps);
+         pool_seek(&pool, job->first + n);
+         policy_streams_reset(&ps);
+         if (job->wordList)
+            len = draw_phrase(job, &pool, &ps, buf + used);
+         else
+         {
+            policy_draw(job->policy, &pool, &ps, buf + used, job->length);
+            len = job->length;
+         }
+         used += len;
+         job->charsOut += len;
+         if (job->newline)
+            buf[used++] = '\n';
+      }
+      write_ordered(buf, used, batch);
+   }
+
+   job->bytesUsed = pool_used(&pool) - dropped - policy_streams_unused(&ps);
+   job->refills = pool.refills;
+   policy_streams_free(&ps);
+   free(buf);
+   return NULL;
+}
+
+void * generate(void * arg)
+{
+   Job * job = arg;
+   RngState st;
+   Pool pool;
+   PolicyStreams ps;
+   size_t recLen, bufLen, len;
+   char * buf = job_buffer(job, &recLen, &bufLen);
+   size_t used = 0;
+   unsigned long long n;
+
+   job->charsOut = 0;
+   pool_init(&pool, job->rng, &st, job->id);
+   policy_streams_init(&ps);
+
+   for (n = 0; n < job->count; n++)
+   {
+      if (used + recLen > bufLen)
+      {
+         write_out(buf, used);
+         used = 0;
+      }
+      if (job->wordList)
+         len = draw_phrase(job, &pool, &ps, buf + used);
+      else
+      {
+         unsigned long long tries = 0;
+
+         for (;;)
+         {
+            policy_draw(job->policy, &pool, &ps, buf + used, job->length);
+            if (!job->unique || unique_add(job->unique, buf + used))
+               break;
+            if (job->unique->dense)
+            {
+               unique_pick(job->unique, &pool, buf + used);
+               break;
+            }
+            if (++tries >= MAXRETRIES && tries >= unique_tries(job->unique))
+            {
+               fprintf(stderr, "randompw: ran out of unique passwords\n");
+               exit(EXIT_FAILURE);
+            }
+         }
+         len = job->length;
+      }
+      used += len;
+      job->charsOut += len;
+      if (job->newline)
+         buf[used++] = '\n';
+   }
+   if (used)
+      write_out(buf, used);
+
+   // characters mapped ahead of time weren't used, nor was their entropy
+   job->bytesUsed = pool_used(&pool) - policy_streams_unused(&ps);
+   job->refills = pool.refills;
+   policy_streams_free(&ps);
+   free(buf);
+   return NULL;
+}
+
+/* --serve: the charsets clients can ask for by name */
+typedef struct
+{
+   const char * name;
+   const char * chars;
+   int ranges;                      // chars is a --range style spec
+} ServeCharset;
+
+const ServeCharset serveSets[] =
+{
+   { "an", ALPHANUM, 0 },
+   { "alpha", ALPHAONLY, 0 },
+   { "num", NUMONLY, 0 },
+   { "all", ALPHANUMSPECIAL, 0 },
+   { "ascii", ASCIIRANGE, 1 },
+};
+#define NSERVESETS (sizeof(serveSets) / sizeof(serveSets[0]))
+
+Sampler serveSamplers[NSERVESETS];
+
+/* one client */
+typedef struct
+{
+   int in;
+   int out;
+   const Policy * policy;           // for "default"
+   const Backend * rng;
+   unsigned id;
+} Conn;
+
+/* per client generator state */
+typedef struct
+{
+   RngState st;
+   Pool pool;
+   PolicyStreams ps;
+   CharStream named[NSERVESETS];
+   char customSpec[REQLEN];         // last --range style charset asked for
+   char * customChars;
+   Sampler custom;
+   CharStream customStream;
+   char out[OUTBUFLEN];
+   size_t used;
+} ConnState;
+
+void serve_init()
+{
+   unsigned i;
+
+   for (i = 0; i < NSERVESETS; i++)
+   {
+      const char * chars = serveSets[i].chars;
+
+      if (serveSets[i].ranges)
+         chars = expand_ranges(chars);
+      sampler_init(&serveSamplers[i], chars, strlen(chars));
+   }
+}
+
+static int conn_flush(const Conn * conn, ConnState * cs)
+{
+   int ret = write_all(conn->out, cs->out, cs->used);
+   cs->used = 0;
+   return ret;
+}
+
+static int conn_error(const Conn * conn, ConnState * cs, const char * msg)
+{
+   cs->used = snprintf(cs->out, sizeof(cs->out), "ERR %s\n", msg);
+   return conn_flush(conn, cs);
+}
+
+// answer one request line; returns -1 if the client has gone
+int serve_request(const Conn * conn, ConnState * cs, char * line)
+{
+   char name[REQLEN] = "default";
+   unsigned long length;
+   unsigned long long count = 1, n;
+   const Sampler * smp = NULL;
+   CharStream * stream = NULL;
+   int fields;
+   unsigned i;
 
-#define PASSLEN 8
+   fields = sscanf(line, "%lu %511s %llu", &length, name, &count);
+   if (fields < 1)
+      return conn_error(conn, cs, "expected: <length> [<charset> [<count>]]");
+   if (!length || length > MAXLEN || !count)
+      return conn_error(conn, cs, "bad length or count");
 
-#define NUMONLY "1234567890"
-#define ALPHAONLY \
-   "qwertyuiopQWERYTUIOPasdfghjklASDFGHJKLzxcvbnmZXCVBNM"
-#define ALPHANUM \
-   "qwertyuiopQWERYTUIOPasdfghjklASDFGHJKLzxcvbnmZXCVBNM1234567890"
+   if (strcmp(name, "default") == 0)
+   {
+      const char * err = policy_check(conn->policy, length);
 
-   /* There are too many special cases for the following to be really
-    * practical, if it was used as-is. A better approach would be to
-    * just use a certain subset of ASCII with an option to exclude a
-    * specified set of characters */
-#define ALPHANUMSPECIAL \
-   "qwertyuiopQWERYTUIOPasdfghjklASDFGHJKLzxcvbnmZXCVBNM1234567890_-+="
+      if (err)
+         return conn_error(conn, cs, err);
+   }
+   else
+   {
+      for (i = 0; i < NSERVESETS; i++)
+         if (strcmp(name, serveSets[i].name) == 0)
+         {
+            smp = &serveSamplers[i];
+            stream = &cs->named[i];
+         }
+      if (!smp)
+      {
+         // compile a custom charset, kept until the client asks for another
+         if (strcmp(name, cs->customSpec) != 0)
+         {
+            char * chars = expand_ranges(name);
+
+            if (strlen(chars) < 2 || strlen(chars) > MAXCHARS)
+            {
+               free(chars);
+               return conn_error(conn, cs, "need between 2 and 65536 characters");
+            }
+            free(cs->customChars);
+            cs->customChars = chars;
+            strcpy(cs->customSpec, name);
+            sampler_init(&cs->custom, chars, strlen(chars));
+            cs->customStream.pos = cs->customStream.len = 0;
+         }
+         smp = &cs->custom;
+         stream = &cs->customStream;
+      }
+   }
+
+   for (n = 0; n < count; n++)
+   {
+      if (cs->used + length + 1 > sizeof(cs->out) && conn_flush(conn, cs) < 0)
+         return -1;
+      if (smp)
+         draw_chars(smp, &cs->pool, stream, cs->out + cs->used, length);
+      else
+         policy_draw(conn->policy, &cs->pool, &cs->ps, cs->out + cs->used,
+                     length);
+      cs->used += length;
+      cs->out[cs->used++] = '\n';
+   }
+   return conn_flush(conn, cs);
+}
+
+void * serve_conn(void * arg)
+{
+   Conn * conn = arg;
+   ConnState * cs = calloc(1, sizeof(ConnState));
+   char req[REQLEN];
+   size_t have = 0;
+   int skip = 0;                    // dropping the rest of a long line
+
+   if (!cs)
+   {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   // have entropy ready before the first request arrives
+   pool_init(&cs->pool, conn->rng, &cs->st, conn->id);
+   pool_refill(&cs->pool);
+
+   for (;;)
+   {
+      char * nl;
+      ssize_t got;
+
+      // answer every complete line we have
+      while ((nl = memchr(req, '\n', have)))
+      {
+         *nl = '\0';
+         if (!skip && serve_request(conn, cs, req) < 0)
+            goto done;
+         skip = 0;
+         have -= nl + 1 - req;
+         memmove(req, nl + 1, have);
+      }
+      if (have == sizeof(req))
+      {
+         if (!skip && conn_error(conn, cs, "request too long") < 0)
+            break;
+         skip = 1;
+         have = 0;
+      }
+
+      got = read(conn->in, req + have, sizeof(req) - have);
+      if (got < 0 && errno == EINTR)
+         continue;
+      if (got <= 0)
+         break;
+      have += got;
+   }
+
+done:
+   if (conn->in != STDIN_FILENO)
+      close(conn->in);
+   policy_streams_free(&cs->ps);
+   free(cs->customChars);
+   free(cs);
+   free(conn);
+   return NULL;
+}
+
+// serve stdin/stdout, or every client of a Unix socket at path
+int do_serve(const Policy * policy, const Backend * rng, const char * path)
+{
+   struct sockaddr_un addr;
+   struct stat st;
+   unsigned id = 0;
+   int sock;
+
+   signal(SIGPIPE, SIG_IGN);
+   serve_init();
+
+   if (!path)
+   {
+      Conn * conn = calloc(1, sizeof(Conn));
+      if (!conn)
+         return EXIT_FAILURE;
+      conn->in = STDIN_FILENO;
+      conn->out = STDOUT_FILENO;
+      conn->policy = policy;
+      conn->rng = rng;
+      serve_conn(conn);
+      return EXIT_SUCCESS;
+   }
+
+   if (strlen(path) >= sizeof(addr.sun_path))
+   {
+      fprintf(stderr, "randompw: socket path too long\n");
+      return EXIT_FAILURE;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   // replace a stale socket, but never anything else, and never one a
+   // server is still listening on
+   if (lstat(path, &st) == 0)
+   {
+      if (!S_ISSOCK(st.st_mode))
+      {
+         fprintf(stderr, "randompw: %s exists and is not a socket\n", path);
+         return EXIT_FAILURE;
+      }
+      sock = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (sock < 0)
+      {
+         perror("socket");
+         return EXIT_FAILURE;
+      }
+      if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      {
+         fprintf(stderr, "randompw: %s is already being served\n", path);
+         close(sock);
+         return EXIT_FAILURE;
+      }
+      if (errno != ECONNREFUSED)
+      {
+         perror(path);
+         close(sock);
+         return EXIT_FAILURE;
+      }
+      close(sock);
+      unlink(path);
+   }
+
+   sock = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+       || listen(sock, 64) != 0)
+   {
+      perror(path);
+      return EXIT_FAILURE;
+   }
+
+   for (;;)
+   {
+      pthread_t thread;
+      Conn * conn;
+      int fd = accept(sock, NULL, NULL);
+
+      if (fd < 0)
+      {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         perror("accept");
+         return EXIT_FAILURE;
+      }
+
+      conn = calloc(1, sizeof(Conn));
+      if (!conn)
+      {
+         close(fd);
+         continue;
+      }
+      conn->in = conn->out = fd;
+      conn->policy = policy;
+      conn->rng = rng;
+      conn->id = id++;
+      if (pthread_create(&thread, NULL, serve_conn, conn) != 0)
+      {
+         close(fd);
+         free(conn);
+         continue;
+      }
+      pthread_detach(thread);
+   }
+}
+
+static double elapsed(const struct timespec * t0)
+{
+   struct timespec t1;
+
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static uint64_t cycles()
+{
+#ifdef HAVE_X86_SIMD
+   return __rdtsc();
+#else
+   return 0;
+#endif
+}
+
+// chi-square of the character counts, as a z score (Wilson-Hilferty)
+double chisq_z(const Sampler * smp, Pool * pool, CharStream * cs,
+               double * perDf)
+{
+   static char buf[CHISQCHARS];
+   unsigned long counts[256];
+   double expect = (double)CHISQCHARS / smp->size, chi = 0, df, x;
+   unsigned i;
+
+   memset(counts, 0, sizeof(counts));
+   draw_chars(smp, pool, cs, buf, CHISQCHARS);
+   for (i = 0; i < CHISQCHARS; i++)
+      counts[(unsigned char)buf[i]]++;
+   for (i = 0; i < smp->size; i++)
+   {
+      x = counts[(unsigned char)smp->chars[i]] - expect;
+      chi += x * x / expect;
+   }
+
+   df = smp->size - 1;
+   *perDf = chi / df;
+   x = 2 / (9 * df);
+   return (cbrt(*perDf) - (1 - x)) / sqrt(x);
+}
+
+/* time every backend over a few charsets and lengths, single threaded */
+int do_bench()
+{
+   static const char * sets[] = { NUMONLY, "a-z", ALPHANUM, ASCIIRANGE };
+   static const unsigned lengths[] = { 8, 16, 32 };
+   static char buf[BENCHCHARS];
+   int failed = 0;
+   unsigned b, c, l;
+
+   mapKernel = choose_kernel(0);
+   printf("%-10s %5s %4s %12s %9s %11s %8s %s\n", "backend", "chars", "len",
+          "pw/s", "MB/s", "cycles/chr", "chi2/df", "uniform");
+
+   for (b = 0; b < NBACKENDS; b++)
+   {
+      const Backend * rng = &backends[b];
+
+      if (rng->available && !rng->available())
+      {
+         printf("%-10s not available on this CPU\n", rng->name);
+         continue;
+      }
+
+      for (c = 0; c < sizeof(sets) / sizeof(sets[0]); c++)
+      {
+         char * chars = expand_ranges(sets[c]);
+         Sampler smp;
+
+         sampler_init(&smp, chars, strlen(chars));
+         for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+         {
+            unsigned long n, count = BENCHCHARS / lengths[l];
+            static CharStream cs;
+            struct timespec t0;
+            RngState st;
+            Pool pool;
+            uint64_t c0, c1;
+            double secs, perDf, z;
+
+            pool_init(&pool, rng, &st, 0);
+            cs.pos = cs.len = 0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            c0 = cycles();
+            for (n = 0; n < count; n++)
+               draw_chars(&smp, &pool, &cs, buf + n * lengths[l], lengths[l]);
+            c1 = cycles();
+            secs = elapsed(&t0);
+
+            z = chisq_z(&smp, &pool, &cs, &perDf);
+            failed |= z > 4;
+            printf("%-10s %5u %4u %12.0f %9.1f ", rng->name, smp.size,
+                   lengths[l], count / secs, count * lengths[l] / secs / 1e6);
+            if (c1 > c0)
+               printf("%11.2f", (double)(c1 - c0) / (count * lengths[l]));
+            else
+               printf("%11s", "-");
+            printf(" %8.3f %s\n", perDf, z > 4 ? "FAIL" : "ok");
+         }
+         free(chars);
+      }
+   }
+
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 void do_usage()
 {
-   // TODO: print usage message
+   fprintf(stderr, "Usage: randompw [options]\n\
+   --alpha           letters only\n\
+   -n, --num         digits only\n\
+   --an              letters and digits (default)\n\
+   --all             letters, digits and _-+=\n\
+   --chars= <chars>  use the given characters\n\
+   --range <spec>    use ranges of characters, e.g. a-zA-Z0-9\n\
+   --ascii           all printable ASCII characters except space\n\
+   --exclude <chars> don't use these characters\n\
+   --noambiguous     exclude characters that look alike (0Oo1Il|`\'\")\n\
+   --firstalpha      first character is a letter\n\
+   --minlower <n>    at least n lowercase letters (also --minupper,\n\
+                     --mindigit and --minsymbol)\n\
+   -l <length>       password length (default %d)\n\
+   -c <count>        print count passwords, one per line\n\
+   -t <threads>      threads to use with -c (default one per CPU)\n\
+   --stats           print entropy use to stderr\n\
+   --scalar          don't use SIMD to map random bytes to characters\n\
+   --rng <name>      random source: getrandom, chacha, aes or random\n\
+                     (default getrandom, or chacha with -c)\n\
+   --bench           time each random source and check its output\n\
+   --words <n>       make a passphrase of n words from --wordlist <file>\n\
+   --sep <str>       put str between words (default a space)\n\
+   --randsep         put a random character from the charset between words\n\
+   --unique          never print the same password twice\n\
+   --seed <hex>      reproducible passwords: number i depends only on the\n\
+                     seed and i, not on -t (see also --start <i>)\n\
+   --serve           answer \"<length> [<charset> [<count>]]\" lines from\n\
+                     stdin, or from clients of --socket <path>\n",
+           PASSLEN);
 }
 
 int main(int argc, char ** argv)
 {
    int i = 0;                       // iterator
-   int firstAlpha = 0;              // First character alphabetic
    char * validChars = ALPHANUM;    // Character set to use
+   char * exclude = NULL;           // Characters not to use
+   unsigned length = PASSLEN;       // Characters per password
+   unsigned long long count = 0;    // Passwords to print, 0 = one, no newline
+   long threads = 0;                // Threads to use, 0 = one per CPU
+   int stats = 0;                   // Print entropy use
+   int unique = 0;                  // Never print the same password twice
+   int serve = 0;                   // Answer requests until EOF
+   char * socketPath = NULL;        // Serve this Unix socket, not stdin
+   uint32_t seedKey[SEEDLEN / 4];   // --seed as a ChaCha20 key
+   int seeded = 0;
+   unsigned long long start = 0;    // --seed: index of the first password
+   int startSet = 0;
+   UniqueSet * uniqueSet = NULL;
+   int forceScalar = 0;             // Don't use the SIMD mapping kernels
+   Policy policy;
+   const Backend * rng = NULL;      // Random source, NULL = default
+   unsigned long nwords = 0;        // Words per passphrase, 0 = password
+   char * wordListPath = NULL;
+   WordList wordList;
+   char * sep = " ";                // Between words, NULL = random
+   const char * err;
+   Job jobs[MAXTHREADS];
+
+   memset(&policy, 0, sizeof(policy));
 
    //parse commandline
    for (i = 1; i < argc; i++)
@@ -47,6 +2782,72 @@ int main(int argc, char ** argv)
       if (strcmp(argv[i], "--num") == 0) validChars = NUMONLY;
       if (strcmp(argv[i], "--an") == 0) validChars = ALPHANUM;
       if (strcmp(argv[i], "--all") == 0) validChars = ALPHANUMSPECIAL;
+      if (strcmp(argv[i], "--ascii") == 0)
+         validChars = expand_ranges(ASCIIRANGE);
+      if (strcmp(argv[i], "--noambiguous") == 0)
+      {
+         char * tmp = malloc((exclude ? strlen(exclude) : 0)
+                             + strlen(AMBIGUOUS) + 1);
+         if (!tmp)
+         {
+            fprintf(stderr, "Out of memory!\n");
+            return EXIT_FAILURE;
+         }
+         sprintf(tmp, "%s%s", exclude ? exclude : "", AMBIGUOUS);
+         exclude = tmp;
+      }
+
+      if (strcmp(argv[i], "--range") == 0 || strcmp(argv[i], "--exclude") == 0)
+      {
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         if (argv[i][2] == 'r')
+            validChars = expand_ranges(argv[++i]);
+         else
+         {
+            char * tmp = malloc((exclude ? strlen(exclude) : 0)
+                                + strlen(argv[i + 1]) + 1);
+            if (!tmp)
+            {
+               fprintf(stderr, "Out of memory!\n");
+               return EXIT_FAILURE;
+            }
+            sprintf(tmp, "%s%s", exclude ? exclude : "", argv[++i]);
+            exclude = tmp;
+         }
+      }
+
+      if (strcmp(argv[i], "--minlower") == 0
+          || strcmp(argv[i], "--minupper") == 0
+          || strcmp(argv[i], "--mindigit") == 0
+          || strcmp(argv[i], "--minsymbol") == 0)
+      {
+         char * end;
+         unsigned long val;
+
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         val = strtoul(argv[i + 1], &end, 10);
+         if (*end || val > MAXLEN)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         switch (argv[i][5])
+         {
+            case 'l': policy.minClass[CLASS_LOWER] = val; break;
+            case 'u': policy.minClass[CLASS_UPPER] = val; break;
+            case 'd': policy.minClass[CLASS_DIGIT] = val; break;
+            default:  policy.minClass[CLASS_SYMBOL] = val; break;
+         }
+         i++;
+      }
 
       if (strcmp(argv[i], "--chars=") == 0)  // use characters from CLI
       {
@@ -59,25 +2860,282 @@ int main(int argc, char ** argv)
          }
       }
 
-      if (strcmp(argv[i], "--firstalpha") == 0) firstAlpha = 1;
-      // TODO: firstalpha not actually implemented
+      if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "-c") == 0
+          || strcmp(argv[i], "-t") == 0)
+      {
+         char * end;
+         unsigned long long val;
+
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         val = strtoull(argv[i + 1], &end, 10);
+         if (*end || !val || (argv[i][1] == 'l' && val > MAXLEN))
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         if (argv[i][1] == 'l') length = val;
+         if (argv[i][1] == 'c') count = val;
+         if (argv[i][1] == 't') threads = val;
+         i++;
+      }
+
+      if (strcmp(argv[i], "--rng") == 0)
+      {
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         rng = find_backend(argv[++i]);
+         if (!rng)
+         {
+            fprintf(stderr, "randompw: no random source %s\n", argv[i]);
+            return EXIT_FAILURE;
+         }
+      }
+
+      if (strcmp(argv[i], "--words") == 0 || strcmp(argv[i], "--wordlist") == 0
+          || strcmp(argv[i], "--sep") == 0)
+      {
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         if (argv[i][2] == 's')
+            sep = argv[++i];
+         else if (strcmp(argv[i], "--wordlist") == 0)
+            wordListPath = argv[++i];
+         else
+         {
+            char * end;
+            nwords = strtoul(argv[++i], &end, 10);
+            if (*end || !nwords || nwords > MAXWORDS)
+            {
+               do_usage();
+               return EXIT_FAILURE;
+            }
+         }
+      }
+      if (strcmp(argv[i], "--randsep") == 0) sep = NULL;
+      if (strcmp(argv[i], "--unique") == 0) unique = 1;
+      if (strcmp(argv[i], "--serve") == 0) serve = 1;
+      if (strcmp(argv[i], "--seed") == 0)
+      {
+         unsigned char key[SEEDLEN];
+         size_t k, digits;
+
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         digits = strlen(argv[++i]);
+         if (!digits || digits > SEEDLEN * 2
+             || strspn(argv[i], "0123456789abcdefABCDEF") != digits)
+         {
+            fprintf(stderr, "randompw: --seed needs 1 to %d hex digits\n",
+                    SEEDLEN * 2);
+            return EXIT_FAILURE;
+         }
+         // a big endian number, zero padded on the left, so 1 and 10
+         // are different keys
+         memset(key, 0, sizeof(key));
+         for (k = 0; k < digits; k++)
+         {
+            char c = argv[i][k];
+            unsigned v = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+            size_t nibble = SEEDLEN * 2 - digits + k;
+            key[nibble / 2] |= v << (nibble & 1 ? 0 : 4);
+         }
+         for (k = 0; k < SEEDLEN / 4; k++)
+            seedKey[k] = key[4 * k] | key[4 * k + 1] << 8
+                         | key[4 * k + 2] << 16 | (uint32_t)key[4 * k + 3] << 24;
+         seeded = 1;
+      }
+      if (strcmp(argv[i], "--start") == 0)
+      {
+         char * end;
+
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         start = strtoull(argv[++i], &end, 10);
+         startSet = 1;
+         if (*end || !*argv[i])
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+      }
+      if (strcmp(argv[i], "--socket") == 0)
+      {
+         if (i + 1 >= argc)
+         {
+            do_usage();
+            return EXIT_FAILURE;
+         }
+         socketPath = argv[++i];
+      }
+
+      if (strcmp(argv[i], "--bench") == 0) return do_bench();
+      if (strcmp(argv[i], "--stats") == 0) stats = 1;
+      if (strcmp(argv[i], "--scalar") == 0) forceScalar = 1;
+      if (strcmp(argv[i], "--firstalpha") == 0) policy.firstAlpha = 1;
    }
 
    // check we have something to put in the password
-   unsigned validCharSize = strlen(validChars) - 1;
-   if (validCharSize < 2)
+   err = policy_compile(&policy, validChars, exclude, length);
+   if (err)
    {
+      fprintf(stderr, "randompw: %s\n", err);
       do_usage();
       return EXIT_FAILURE;
    }
+   mapKernel = choose_kernel(forceScalar);
 
-   // init RNG - without doing this explicitly it will use a seed of 1
-   // every time this is run
-   srandom(time(NULL));
+   if (startSet && !seeded)
+   {
+      fprintf(stderr, "randompw: --start only works with --seed\n");
+      return EXIT_FAILURE;
+   }
+   if (seeded && (unique || serve || socketPath
+                  || (rng && strcmp(rng->name, "chacha") != 0)))
+   {
+      fprintf(stderr, "randompw: --seed can't be used with --unique, "
+              "--serve or another --rng\n");
+      return EXIT_FAILURE;
+   }
+   if ((serve || socketPath) && (unique || nwords || wordListPath || stats))
+   {
+      fprintf(stderr, "randompw: --serve can't be used with --unique, "
+              "--words, --wordlist or --stats\n");
+      return EXIT_FAILURE;
+   }
+
+   if (serve || socketPath)
+      return do_serve(&policy, rng ? rng : find_backend("chacha"), socketPath);
+
+   if (nwords || wordListPath)
+   {
+      if (!nwords || !wordListPath)
+      {
+         do_usage();
+         return EXIT_FAILURE;
+      }
+      err = wordlist_open(&wordList, wordListPath);
+      if (err)
+      {
+         fprintf(stderr, "randompw: %s\n", err);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (unique)
+   {
+      uint64_t space;
+
+      if (nwords)
+      {
+         fprintf(stderr, "randompw: --unique only works for passwords\n");
+         return EXIT_FAILURE;
+      }
+      uniqueSet = calloc(1, sizeof(UniqueSet));
+      if (!uniqueSet)
+      {
+         fprintf(stderr, "Out of memory!\n");
+         return EXIT_FAILURE;
+      }
+      space = keyspace(uniqueSet, policy.all.chars, length);
+      {
+         uint64_t size[NCLASSES] = { 0 };
+
+         for (i = 0; i < (int)uniqueSet->base; i++)
+            size[char_class(uniqueSet->symbol[i])]++;
+         uniqueSet->valid = policy_count(&policy, size, length);
+      }
+      if (count > uniqueSet->valid)
+      {
+         fprintf(stderr, "randompw: only %llu different passwords possible\n",
+                 (unsigned long long)uniqueSet->valid);
+         return EXIT_FAILURE;
+      }
+      unique_init(uniqueSet, space, length, count,
+                  !policy.required && !policy.firstAlpha);
+      if (!uniqueSet->dense && count > uniqueSet->valid / 2)
+         fprintf(stderr, "randompw: warning: %llu passwords is %.0f%% of the "
+                 "%llu possible, generation will slow down near the end\n",
+                 count, 100.0 * count / uniqueSet->valid,
+                 (unsigned long long)uniqueSet->valid);
+   }
+
+   // split the passwords between threads
+   if (threads == 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if (threads > MAXTHREADS) threads = MAXTHREADS;
+   if (threads < 1 || count == 0) threads = 1;
+   if ((unsigned long long)threads > count / PERTHREADMIN)
+      threads = count / PERTHREADMIN ? count / PERTHREADMIN : 1;
+
+   for (i = 0; i < threads; i++)
+   {
+      jobs[i].policy = &policy;
+      jobs[i].unique = uniqueSet;
+      jobs[i].wordList = nwords ? &wordList : NULL;
+      jobs[i].nwords = nwords;
+      jobs[i].sep = sep;
+      jobs[i].length = length;
+      jobs[i].newline = count != 0;
+      jobs[i].rng = rng ? rng : find_backend(count ? "chacha" : "getrandom");
+      jobs[i].count = count ? count / threads + ((unsigned long long)i < count % threads) : 1;
+      jobs[i].id = i;
+      jobs[i].seed = seeded ? seedKey : NULL;
+      jobs[i].first = start;
+      jobs[i].threads = threads;
+      if (seeded)
+         jobs[i].count = count ? count : 1;
+   }
+
+   // generate the passwords
+   for (i = 1; i < threads; i++)
+   {
+      if (pthread_create(&jobs[i].thread, NULL,
+                         seeded ? generate_seeded : generate, &jobs[i]) != 0)
+      {
+         perror("pthread_create");
+         return EXIT_FAILURE;
+      }
+   }
+   if (seeded)
+      generate_seeded(&jobs[0]);
+   else
+      generate(&jobs[0]);
+   for (i = 1; i < threads; i++)
+      pthread_join(jobs[i].thread, NULL);
+
+   if (stats)
+   {
+      unsigned long long bytes = 0, refills = 0, chars = 0;
 
-   // generate the password
-   for (i = 0; i < PASSLEN; i++)
-      putchar(validChars[random() % validCharSize]);
+      for (i = 0; i < threads; i++)
+      {
+         chars += jobs[i].charsOut;
+         bytes += jobs[i].bytesUsed;
+         refills += jobs[i].refills;
+      }
+      fprintf(stderr, "%s%llu chars from %llu random bytes (%.4f bytes/char), "
+              "%llu pool refills\n", count ? "" : "\n",
+              chars, bytes, (double)bytes / chars, refills);
+      if (nwords)
+         fprintf(stderr, "%u words in list, %.1f bits per passphrase\n",
+                 wordList.count, nwords * log2(wordList.count));
+   }
 
    return EXIT_SUCCESS;
 }
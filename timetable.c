@@ -36,6 +36,11 @@ Commandline:
 
    -P as -p but ignores days on which nothing occurs.
 
+The default listing is saved to ~/.timetable.cache (or <filename>.cache)
+and replayed as-is until the timetable file changes, the options or time
+zone differ, or an entry starts or finishes, so it is cheap to run from a
+shell prompt.
+
 ~/.timetable format:
 
    <weekday> <start time> <end time> <description>
@@ -99,6 +104,16 @@ Portions based on Emil Mikulic's todo.c: http://dmr.ath.cx/stuff/code/todo.c
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
 
 /* these are all with black background (40) */
 #define ANSI_RED     "\033[0;31m"
@@ -125,26 +140,73 @@ unsigned linenum = 0;
 unsigned debugMode = 0;
 #define MAX_DAYS 7
 
-time_t now, limit, today;
+time_t now, limit, today, tomorrow;
 unsigned thisWeekday;
 unsigned thisYear;
 
 
-/* Assuming people run the program at a random time this should be
- * efficient, as times are pushed forward after the now time */
+#define DAYMINUTES 1440
+
+/* Entries are kept in one flat array, sorted by end time once the file has
+ * been read. Times are minutes after midnight today, so a whole week fits
+ * in 16 bits; the description is an offset into the string pool below. */
 struct _tt_entry
 {
-   time_t start;
-   time_t end;
-   char * desc;
-   unsigned days;
-
-   struct _tt_entry * closer;
-   struct _tt_entry * further;
+   uint16_t start;
+   uint16_t end;
+   uint32_t desc;
 };
 
 typedef struct _tt_entry TTEntry;
-TTEntry * head;
+TTEntry * entries = NULL;
+unsigned numEntries = 0;
+unsigned entriesSize = 0;
+#define SORTRUN 16   //runs insertion sorted before merging
+
+/* Descriptions are interned so repeated ones ("**** Work shift ****") are
+ * only stored once. Normally only the text after the times is kept and the
+ * rest of the line is rebuilt when printing; lines not in the canonical
+ * "ddd hh:mm hh:mm" form are stored whole and flagged with DESC_RAW. */
+#define DESC_RAW 0x80000000u
+char * strPool = NULL;
+uint32_t strPoolLen = 0;
+uint32_t strPoolSize = 0;
+uint32_t * strHash = NULL;    // pool offset + 1, 0 is empty
+uint32_t strHashSize = 0;
+uint32_t strHashUsed = 0;
+
+/* The default listing is saved in <ttfile>.cache, keyed on the file's
+ * identity, the options used and the UTC offset, and replayed until the
+ * file changes or the next entry starts/ends (or midnight). It is written
+ * as it is printed, with len filled in once the listing is complete. */
+#define CACHEEXT ".cache"
+#define CACHEMAGIC "TTCACHE2"
+
+struct _tt_cache
+{
+   char magic[8];
+   dev_t dev;
+   ino_t ino;
+   off_t size;
+   time_t mtime;
+   time_t ctime;
+   time_t made;
+   time_t validUntil;
+   long utcOffset;
+   unsigned char days;
+   char monochrome;
+   char mode;
+   uint32_t len;
+};
+
+typedef struct _tt_cache TTCache;
+char * cacheFile = NULL;
+char * cacheTmp = NULL;
+FILE * cacheOut = NULL;
+TTCache cacheHdr;
+
+static const char * dayNames[] =
+   { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
 
 
 static void *
@@ -183,41 +245,272 @@ getline(FILE *f)
    return line;
 }
 
-static TTEntry *
-insert(TTEntry * node, TTEntry * newent)
+static void *
+xrealloc(void * p, const size_t s)
 {
-   if (node == NULL)
+   void *tmp = realloc(p, s);
+   if (!tmp)
    {
-      if (debugMode)
-         printf("Inserting %s\n", newent->desc);
-      return newent;
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
    }
+   return tmp;
+}
 
-   if (debugMode)
-      printf("Parsing %s\n", node->desc);
+static uint32_t
+hash_str(const char * str)
+{
+   uint32_t h = 2166136261u;  //FNV-1a
+
+   while (*str)
+      h = (h ^ (unsigned char)*str++) * 16777619u;
+   return h;
+}
+
+/// returns the pool offset of str, adding it to the pool if it isn't there
+static uint32_t
+intern(const char * str)
+{
+   uint32_t len = strlen(str) + 1;
+   uint32_t i, off;
+
+   //grow the hash table at 50% load
+   if (strHashUsed * 2 >= strHashSize)
+   {
+      uint32_t * old = strHash;
+      uint32_t oldSize = strHashSize;
+
+      strHashSize = oldSize ? oldSize * 2 : 256;
+      strHash = xmalloc(strHashSize * sizeof(uint32_t));
+      memset(strHash, 0, strHashSize * sizeof(uint32_t));
+      for (i = 0; i < oldSize; i++)
+      {
+         uint32_t j;
+         if (!old[i]) continue;
+         j = hash_str(strPool + old[i] - 1) & (strHashSize - 1);
+         while (strHash[j])
+            j = (j + 1) & (strHashSize - 1);
+         strHash[j] = old[i];
+      }
+      free(old);
+   }
+
+   i = hash_str(str) & (strHashSize - 1);
+   while (strHash[i])
+   {
+      if (strcmp(strPool + strHash[i] - 1, str) == 0)
+         return strHash[i] - 1;
+      i = (i + 1) & (strHashSize - 1);
+   }
+
+   if (strPoolLen + len > strPoolSize)
+   {
+      while (strPoolLen + len > strPoolSize)
+         strPoolSize = strPoolSize ? strPoolSize * 2 : 4096;
+      if (strPoolSize >= DESC_RAW)
+      {
+         fprintf(stderr, "Out of memory!\n");
+         exit(EXIT_FAILURE);
+      }
+      strPool = xrealloc(strPool, strPoolSize);
+   }
+
+   off = strPoolLen;
+   memcpy(strPool + off, str, len);
+   strPoolLen += len;
+   strHash[i] = off + 1;
+   strHashUsed++;
+   return off;
+}
+
+/// writes the canonical "ddd hh:mm hh:mm " line prefix into buf
+static void
+format_prefix(char * buf, int weekday, int shour, int smin, int ehour, int emin)
+{
+   sprintf(buf, "%s %02d:%02d %02d:%02d ",
+           dayNames[weekday], shour, smin, ehour, emin);
+}
+
+/// returns the full timetable line for an entry
+/// not thread safe
+static const char *
+entry_desc(const TTEntry * ent)
+{
+   static char line[BUFLEN + 16];
+   unsigned day = ent->start / DAYMINUTES;
+   unsigned smin = ent->start - day * DAYMINUTES;
+   unsigned emin = ent->end - day * DAYMINUTES;
+
+   if (ent->desc & DESC_RAW)
+      return strPool + (ent->desc & ~DESC_RAW);
+
+   format_prefix(line, (thisWeekday + day) % 7,
+                 smin / 60, smin % 60, emin / 60, emin % 60);
+   strcat(line, strPool + ent->desc);
+   return line;
+}
+
+static time_t
+entry_time(unsigned minutes)
+{
+   return today + (time_t)minutes * 60;
+}
+
+//orders by end, then start
+static int
+entry_cmp(const TTEntry * a, const TTEntry * b)
+{
+   if (a->end != b->end)
+      return a->end < b->end ? -1 : 1;
+   if (a->start != b->start)
+      return a->start < b->start ? -1 : 1;
+   return 0;
+}
+
+static void
+swap_entries(unsigned a, unsigned b, unsigned n)
+{
+   while (n--)
+   {
+      TTEntry t = entries[a];
+      entries[a++] = entries[b];
+      entries[b++] = t;
+   }
+}
+
+//swaps the blocks [a,m) and [m,b) round without a scratch buffer
+static void
+rotate_entries(unsigned a, unsigned m, unsigned b)
+{
+   unsigned i = m - a, j = b - m;
+
+   if (!i || !j) return;
+   while (i != j)
+   {
+      if (i > j)
+      {
+         swap_entries(m - i, m, j);
+         i -= j;
+      }
+      else
+      {
+         swap_entries(m - i, m + j - i, i);
+         j -= i;
+      }
+   }
+   swap_entries(m - i, m, i);
+}
+
+//stable in-place merge of the sorted runs [a,m) and [m,b) (SymMerge)
+static void
+merge_entries(unsigned a, unsigned m, unsigned b)
+{
+   unsigned mid, n, lo, hi, end;
 
-   if (newent->end > node->end)
-      node->further = insert(node->further, newent);
-   else if (newent->end < node->end)
-      node->closer = insert(node->closer, newent);
+   if (m - a == 1)
+   {
+      //binary insert the single left entry after its equals on the right
+      lo = m;
+      hi = b;
+      while (lo < hi)
+      {
+         unsigned h = lo + (hi - lo) / 2;
+         if (entry_cmp(&entries[h], &entries[a]) < 0)
+            lo = h + 1;
+         else
+            hi = h;
+      }
+      rotate_entries(a, m, lo);
+      return;
+   }
+   if (b - m == 1)
+   {
+      lo = a;
+      hi = m;
+      while (lo < hi)
+      {
+         unsigned h = lo + (hi - lo) / 2;
+         if (entry_cmp(&entries[m], &entries[h]) >= 0)
+            lo = h + 1;
+         else
+            hi = h;
+      }
+      rotate_entries(lo, m, b);
+      return;
+   }
+
+   mid = a + (b - a) / 2;
+   n = mid + m;
+   if (m > mid)
+   {
+      lo = n - b;
+      hi = mid;
+   }
    else
    {
-      if (newent->start > node->start)
-         node->further = insert(node->further, newent);
+      lo = a;
+      hi = m;
+   }
+   while (lo < hi)
+   {
+      unsigned c = lo + (hi - lo) / 2;
+      if (entry_cmp(&entries[n - 1 - c], &entries[c]) >= 0)
+         lo = c + 1;
       else
-         node->closer = insert(node->closer, newent);
+         hi = c;
+   }
+   end = n - lo;
+   rotate_entries(lo, m, end);
+   if (a < lo && lo < mid)
+      merge_entries(a, lo, mid);
+   if (mid < end && end < b)
+      merge_entries(mid, end, b);
+}
+
+//stable sort that needs no copy of the array: insertion sort short runs,
+//then merge them in place. entries is reversed first so equal entries
+//come out newest first, as they did when they were kept in a tree
+static void
+sort_entries()
+{
+   unsigned width, i, j;
+
+   for (i = 0; i < numEntries / 2; i++)
+   {
+      TTEntry t = entries[i];
+      entries[i] = entries[numEntries - 1 - i];
+      entries[numEntries - 1 - i] = t;
+   }
+
+   for (i = 1; i < numEntries; i++)
+   {
+      TTEntry t = entries[i];
+
+      for (j = i; j % SORTRUN && entry_cmp(&t, &entries[j - 1]) < 0; j--)
+         entries[j] = entries[j - 1];
+      entries[j] = t;
    }
 
-   return node;
+   for (width = SORTRUN; width < numEntries; width *= 2)
+   {
+      for (i = 0; i + width < numEntries; i += 2 * width)
+      {
+         unsigned end = numEntries - i > 2 * width ? i + 2 * width
+                                                   : numEntries;
+         merge_entries(i, i + width, end);
+      }
+   }
 }
 
 static TTEntry *
-add_TTEntry(int shour, int smin, int ehour, int emin, int weekday, char * desc)
+add_TTEntry(int shour, int smin, int ehour, int emin, int weekday,
+            const char * line, const char * text)
 {
    TTEntry * newent = NULL;
+   char prefix[BUFLEN];
    int daysAway;
-   time_t end;
-   time_t start;
+   long end;
+   long start;
    
    //determine how many days this entry is from the future
    if (weekday < thisWeekday)
@@ -233,51 +526,65 @@ add_TTEntry(int shour, int smin, int ehour, int emin, int weekday, char * desc)
    {
       if (debugMode)
          printf("daysAway > days (%d)\n", days);
-      free(desc);
       return NULL;
    }
 
    //create end time
-   end = today + (daysAway * DAYSECONDS) + (ehour * 3600) + (emin * 60);
+   end = (daysAway * DAYMINUTES) + (ehour * 60) + emin;
    if (debugMode)
-      printf("end: %d\n", end);
+      printf("end: %ld\n", (long)entry_time(end));
 
-   if (limit && end < now)
-   {
-      free(desc);
+   if (limit && entry_time(end) < now)
       return NULL;
-   }
 
    //create start time
-   start = today + (daysAway * DAYSECONDS) + (shour * 3600) + (smin * 60);
+   start = (daysAway * DAYMINUTES) + (shour * 60) + smin;
    if (debugMode)
-      printf("start: %d\n", start);
+      printf("start: %ld\n", (long)entry_time(start));
 
    if (start > end)
    {
       fprintf(stderr, "Start after end at %s:%d.\n", ttFile, linenum);
-      free(desc);
+      return NULL;
+   }
+
+   if (start < 0 || end > UINT16_MAX)
+   {
+      fprintf(stderr, "Time out of range at %s:%d.\n", ttFile, linenum);
       return NULL;
    }
 
    //create the TTEntry
-   newent = xmalloc(sizeof(TTEntry));
+   if (numEntries == entriesSize)
+   {
+      entriesSize = entriesSize ? entriesSize * 2 : 64;
+      entries = xrealloc(entries, entriesSize * sizeof(TTEntry));
+   }
+   newent = &entries[numEntries++];
    newent->start = start;
    newent->end = end;
-   newent->desc = desc;
-   newent->further = NULL;
-   newent->closer = NULL;
-   newent->days = daysAway;
 
-   head = insert(head, newent);
+   //only keep the text if the rest of the line can be rebuilt exactly
+   format_prefix(prefix, weekday, shour, smin, ehour, emin);
+   if (shour >= 0 && shour < 24 && smin >= 0 && smin < 60
+       && emin >= 0 && emin < 60
+       && strlen(prefix) == (size_t)(text - line)
+       && strncmp(prefix, line, text - line) == 0)
+      newent->desc = intern(text);
+   else
+      newent->desc = intern(line) | DESC_RAW;
+
+   if (debugMode)
+      printf("Inserting %s\n", entry_desc(newent));
+
    return newent;
 }
 
 static TTEntry *
 parse_ttline(char * line)
 {
-   char * desc;
-   unsigned left = 0, right = 0;
+   char desc[BUFLEN];
+   unsigned left = 0, right = 0, first;
    int shour = 0, smin = 0, ehour = 0, emin = 0, weekday = 0;
    
    if (!strlen(line)) return NULL;  //blank line
@@ -292,7 +599,8 @@ parse_ttline(char * line)
 
 
    //save the entire line here for the description
-   desc = strdup(line+right);
+   strcpy(desc, line+right);
+   first = right;
 
    //weekday
 
@@ -409,7 +717,8 @@ parse_ttline(char * line)
       printf("Line %d end minute: %s\n", linenum, line+left);
    emin = atoi(line+left);
 
-   return add_TTEntry(shour, smin, ehour, emin, weekday, desc);
+   return add_TTEntry(shour, smin, ehour, emin, weekday,
+                      desc, desc + (right + 1 - first));
 }
 
 static void
@@ -434,27 +743,198 @@ read_ttfile()
          break;
    }
    fclose(f);
+
+   //give back the slack from doubling before sorting in place
+   if (numEntries && numEntries < entriesSize)
+   {
+      entries = xrealloc(entries, numEntries * sizeof(TTEntry));
+      entriesSize = numEntries;
+   }
+   sort_entries();
 }
 
 static void
-printTree(TTEntry * node)
+out_line(const char * colour, const char * desc, const char * normal)
 {
-   if (node == NULL) return;
+   printf("%s%s%s\n", colour, desc, normal);
 
-   if (node->closer) printTree(node->closer);
+   if (cacheOut)
+   {
+      fprintf(cacheOut, "%s%s%s\n", colour, desc, normal);
+      cacheHdr.len += strlen(colour) + strlen(desc) + strlen(normal) + 1;
+   }
+}
 
-   if (monochrome)
-      printf("%s\n", node->desc);
-   else if (node->start < now)
-      printf("%s%s%s\n", ANSI_RED, node->desc, ANSI_NORMAL);
-   else if (node->days == 0)
-      printf("%s%s%s\n", ANSI_YELLOW, node->desc, ANSI_NORMAL);
-   else if (node->days == 1)
-      printf("%s%s%s\n", ANSI_CYAN, node->desc, ANSI_NORMAL);
-   else
-      printf("%s%s%s\n", ANSI_GREEN, node->desc, ANSI_NORMAL);
+static void
+printEntries()
+{
+   unsigned i;
+
+   for (i = 0; i < numEntries; i++)
+   {
+      const TTEntry * ent = &entries[i];
+      const char * desc = entry_desc(ent);
+      unsigned days = ent->start / DAYMINUTES;
+
+      if (monochrome)
+         out_line("", desc, "");
+      else if (entry_time(ent->start) < now)
+         out_line(ANSI_RED, desc, ANSI_NORMAL);
+      else if (days == 0)
+         out_line(ANSI_YELLOW, desc, ANSI_NORMAL);
+      else if (days == 1)
+         out_line(ANSI_CYAN, desc, ANSI_NORMAL);
+      else
+         out_line(ANSI_GREEN, desc, ANSI_NORMAL);
+   }
+}
+
+/// returns the offset of local time from UTC at t, in seconds
+static long
+utc_offset(time_t t)
+{
+   struct tm local = *localtime(&t);
+   struct tm * utc = gmtime(&t);
+   long days = local.tm_yday - utc->tm_yday;
+
+   //the two can only be a day apart, even across new year
+   if (local.tm_year != utc->tm_year)
+      days = local.tm_year > utc->tm_year ? 1 : -1;
+
+   return ((days * 24 + local.tm_hour - utc->tm_hour) * 60
+           + local.tm_min - utc->tm_min) * 60 + local.tm_sec - utc->tm_sec;
+}
+
+/// prints the cached listing if it is still valid, returns TRUE if it was
+static int
+replay_cache()
+{
+   char buf[8192];
+   TTCache hdr;
+   struct stat st, cst;
+   ssize_t got;
+   uint32_t left;
+   int fd;
+
+   if (stat(ttFile, &st) != 0)
+      return 0;
+
+   fd = open(cacheFile, O_RDONLY);
+   if (fd < 0)
+      return 0;
+   got = read(fd, buf, sizeof(buf));
+   if (got < (ssize_t)sizeof(TTCache) || fstat(fd, &cst) != 0)
+   {
+      close(fd);
+      return 0;
+   }
+   memcpy(&hdr, buf, sizeof(hdr));
+
+   //the size check means nothing is printed unless all of it can be
+   if (memcmp(hdr.magic, CACHEMAGIC, sizeof(hdr.magic)) != 0
+       || cst.st_size != (off_t)sizeof(TTCache) + hdr.len
+       || hdr.dev != st.st_dev || hdr.ino != st.st_ino
+       || hdr.size != st.st_size || hdr.mtime != st.st_mtime
+       || hdr.ctime != st.st_ctime
+       || hdr.days != days || hdr.monochrome != monochrome
+       || hdr.mode != mode
+       || now < hdr.made || now >= hdr.validUntil
+       || hdr.utcOffset != utc_offset(now))
+   {
+      close(fd);
+      return 0;
+   }
+
+   //usually the whole listing fits in the first read
+   left = hdr.len;
+   got -= sizeof(TTCache);
+   fwrite(buf + sizeof(TTCache), 1, got < left ? got : left, stdout);
+   left -= got < left ? got : left;
+   while (left && (got = read(fd, buf, sizeof(buf))) > 0)
+   {
+      fwrite(buf, 1, got < left ? got : left, stdout);
+      left -= got < left ? got : left;
+   }
+   close(fd);
+   return 1;
+}
+
+/// starts saving the listing about to be printed for replay_cache()
+static void
+begin_cache()
+{
+   struct stat st;
+   unsigned i;
+   int fd;
+
+   //don't trust a file modified this second, it could change again
+   //without its mtime changing
+   if (stat(ttFile, &st) != 0 || st.st_mtime >= now || st.st_ctime >= now)
+      return;
+
+   memset(&cacheHdr, 0, sizeof(cacheHdr));
+   memcpy(cacheHdr.magic, CACHEMAGIC, sizeof(cacheHdr.magic));
+   cacheHdr.dev = st.st_dev;
+   cacheHdr.ino = st.st_ino;
+   cacheHdr.size = st.st_size;
+   cacheHdr.mtime = st.st_mtime;
+   cacheHdr.ctime = st.st_ctime;
+   cacheHdr.made = now;
+   cacheHdr.utcOffset = utc_offset(now);
+   cacheHdr.days = days;
+   cacheHdr.monochrome = monochrome;
+   cacheHdr.mode = mode;
+
+   //output changes when an entry starts (turns red) or ends (is dropped)
+   cacheHdr.validUntil = tomorrow;
+   for (i = 0; i < numEntries; i++)
+   {
+      time_t t = entry_time(entries[i].start) + 1;
+      if (t > now && t < cacheHdr.validUntil) cacheHdr.validUntil = t;
+      t = entry_time(entries[i].end) + 1;
+      if (t > now && t < cacheHdr.validUntil) cacheHdr.validUntil = t;
+   }
 
-   if (node->further) printTree(node->further);
+   //write to a temporary file and rename so readers never see half of it;
+   //never follow or reuse whatever is already at that name
+   cacheTmp = xmalloc(strlen(cacheFile) + 16);
+   sprintf(cacheTmp, "%s.%d", cacheFile, (int)getpid());
+   fd = open(cacheTmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+   if (fd >= 0 && !(cacheOut = fdopen(fd, "w")))
+   {
+      close(fd);
+      unlink(cacheTmp);
+   }
+   if (!cacheOut)
+   {
+      free(cacheTmp);
+      cacheTmp = NULL;
+      return;
+   }
+
+   //len stays 0 until the listing is complete
+   fwrite(&cacheHdr, sizeof(cacheHdr), 1, cacheOut);
+   cacheHdr.len = 0;
+}
+
+/// fills in the length of the saved listing and puts it in place
+static void
+finish_cache()
+{
+   int ok;
+
+   if (!cacheOut)
+      return;
+
+   ok = fflush(cacheOut) == 0 && !ferror(cacheOut)
+        && pwrite(fileno(cacheOut), &cacheHdr.len, sizeof(cacheHdr.len),
+                  offsetof(TTCache, len)) == sizeof(cacheHdr.len);
+   ok = (fclose(cacheOut) == 0) && ok;
+   cacheOut = NULL;
+   if (!ok || rename(cacheTmp, cacheFile) != 0)
+      unlink(cacheTmp);
+   free(cacheTmp);
+   cacheTmp = NULL;
 }
 
 static void
@@ -470,9 +950,14 @@ do_timetable()
    //read (and sort) the ttfile
    read_ttfile();
 
+   if (!debugMode)
+      begin_cache();
+
    //print the entries in order
    //only those lower than limit will have been added
-   printTree(head);
+   printEntries();
+
+   finish_cache();
 }
 
 static void
@@ -493,22 +978,44 @@ do_editor()
    free(cmd);
 }
 
-/// returns the decirption of what is on at that time, or NULL
-/// Will return the FIRST entry found, does not check for clashes.
-/// TODO: add clashes together somehow or warn on STDERR
-static char *
-check_time(time_t tm, TTEntry * ent)
+/// returns the index of the first entry ending after tm minutes
+static unsigned
+first_ending_after(unsigned tm)
 {
-   if (ent == NULL) return NULL;
+   unsigned lo = 0, hi = numEntries;
 
-   if (ent->start > tm)
-      return check_time(tm, ent->closer);
+   while (lo < hi)
+   {
+      unsigned mid = lo + (hi - lo) / 2;
+      if (entries[mid].end <= tm)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return lo;
+}
 
-   if (ent->end <= tm)
-      return check_time(tm, ent->further);
+/// returns the decirption of what is on at that time, or NULL
+/// Where entries overlap the one finishing soonest wins (so lunch inside
+/// a work shift shows as lunch); identical entries report the one read
+/// first. Clashes are not otherwise checked.
+/// TODO: add clashes together somehow or warn on STDERR
+static const char *
+check_time(unsigned tm)
+{
+   unsigned i;
 
-   //if we reach here it's in this time
-   return ent->desc;
+   for (i = first_ending_after(tm); i < numEntries; i++)
+   {
+      if (entries[i].start <= tm)
+      {
+         //identical entries are newest first; report the one read first
+         while (i + 1 < numEntries && !entry_cmp(&entries[i], &entries[i+1]))
+            i++;
+         return entry_desc(&entries[i]);
+      }
+   }
+   return NULL;
 }
 
 static void
@@ -538,25 +1045,24 @@ printf("Usage:\n\
 
 //returns TRUE if there is ANYTHING between the given times
 static int
-busy_time(TTEntry * ent, time_t start, time_t end)
+busy_time(unsigned start, unsigned end)
 {
-   if (ent == NULL) return 0;
+   unsigned i;
 
-   if (ent->end < start)
-      return busy_time(ent->further, start, end);
-
-   if (ent->start > end)
-      return busy_time(ent->closer, start, end);
-
-   //this entry is between start and end, somewhere
-   return 1;
+   for (i = start ? first_ending_after(start - 1) : 0; i < numEntries; i++)
+   {
+      //this entry is between start and end, somewhere
+      if (entries[i].start <= end)
+         return 1;
+   }
+   return 0;
 }
 
 //returns TRUE if there is ANYTHING on on the day
 static int
 busy_day(int day)
 {
-   time_t start, end;
+   unsigned start, end;
    int daysAway;
 
    //determine how many days the day is from the future
@@ -565,17 +1071,17 @@ busy_day(int day)
    else
       daysAway = day - thisWeekday;
 
-   start = today + (DAYSECONDS * daysAway);
-   end = today + (DAYSECONDS * (daysAway + 1));
+   start = DAYMINUTES * daysAway;
+   end = DAYMINUTES * (daysAway + 1);
 
-   return busy_time(head, start, end);
+   return busy_time(start, end);
 }
 
 //prints one day on one standard 66 line by 80 char page
 static void
 print_day(int day)
 {
-   time_t tm, start, end;
+   unsigned tm, start, end;
    int daysAway;
 
    //determine how many days the day is from the future
@@ -584,8 +1090,8 @@ print_day(int day)
    else
       daysAway = day - thisWeekday;
 
-   start = today + (DAYSECONDS * daysAway);
-   end = today + (DAYSECONDS * (daysAway + 1));
+   start = DAYMINUTES * daysAway;
+   end = DAYMINUTES * (daysAway + 1);
 
    switch(day)
    {
@@ -610,9 +1116,9 @@ print_day(int day)
                break;
    }
 
-   for(tm=start; tm<end; tm+=1800)
+   for(tm=start; tm<end; tm+=30)
    {
-      char * desc = check_time(tm, head);
+      const char * desc = check_time(tm);
       if (desc == NULL)
          printf("-\n");
       else
@@ -654,7 +1160,7 @@ do_printable()
 static void
 busy_line(int day)
 {
-   time_t tm, start, end;
+   unsigned tm, start, end;
    int daysAway;
 
    //determine how many days the day is from the future
@@ -663,12 +1169,12 @@ busy_line(int day)
    else
       daysAway = day - thisWeekday;
 
-   start = today + (DAYSECONDS * daysAway);
-   end = today + (DAYSECONDS * (daysAway + 1));
+   start = DAYMINUTES * daysAway;
+   end = DAYMINUTES * (daysAway + 1);
 
    //trim from 0700-2300
-   start += 3600 * 7;
-   end -= 3600;
+   start += 60 * 7;
+   end -= 60;
 
    switch (day)
    {
@@ -684,9 +1190,9 @@ busy_line(int day)
                break;
    }
 
-   for(tm=start; tm<end; tm+=1800)
+   for(tm=start; tm<end; tm+=30)
    {
-      char * desc = check_time(tm, head);
+      const char * desc = check_time(tm);
       if (NULL == desc)
          printf(" |");
       else
@@ -756,15 +1262,8 @@ int main(int argc, char **argv)
 
    homeDir = getenv("HOME");
 
-   //set now, today, thisWeekday, thisYear - limit set later
+   //set now - today etc are set after the cache is checked
    now = time(NULL);
-   tmptm = localtime(&now);
-   thisWeekday = tmptm->tm_wday;
-   thisYear = tmptm->tm_year; // + 1900
-   tmptm->tm_sec = 0;
-   tmptm->tm_min = 0;
-   tmptm->tm_hour = 0;
-   today = mktime(tmptm);
 
    // check args
    for (i = 1; i < argc; i++)
@@ -800,6 +1299,24 @@ int main(int argc, char **argv)
 
    if (days > MAX_DAYS) days = MAX_DAYS;
 
+   //the default listing can usually be replayed without reading the file
+   cacheFile = (char*) xmalloc(strlen(ttFile) + strlen(CACHEEXT) + 1);
+   sprintf(cacheFile, "%s%s", ttFile, CACHEEXT);
+   if ((mode == 0 || mode == 'r') && !debugMode && replay_cache())
+      return EXIT_SUCCESS;
+
+   //set today, tomorrow, thisWeekday, thisYear - limit set later
+   tmptm = localtime(&now);
+   thisWeekday = tmptm->tm_wday;
+   thisYear = tmptm->tm_year; // + 1900
+   tmptm->tm_sec = 0;
+   tmptm->tm_min = 0;
+   tmptm->tm_hour = 0;
+   today = mktime(tmptm);
+   tmptm->tm_mday++;
+   tmptm->tm_isdst = -1;
+   tomorrow = mktime(tmptm);
+
    switch(mode)
    {
       case 'B':